@@ -0,0 +1,37 @@
+# Writes OUTPUT, a header holding each file of SOURCES as a constant array
+# shader_data::<file name with . as _>, for platforms without resources.
+# Every line of a file becomes its own string literal, which the compiler
+# concatenates, so no single literal runs into compiler length limits. The
+# header is only rewritten when its content changes.
+#
+#   cmake -DOUTPUT=shader_data.hpp "-DSOURCES=a.vert;b.frag" -P embed_shaders.cmake
+
+if(NOT OUTPUT OR NOT SOURCES)
+    message(FATAL_ERROR "usage: cmake -DOUTPUT=header -DSOURCES=files -P embed_shaders.cmake")
+endif()
+
+set(header "// Generated from the shader sources by embed_shaders.cmake; do not edit.\n")
+string(APPEND header "#pragma once\n\nnamespace shader_data\n{\n")
+foreach(source IN LISTS SOURCES)
+    if(source STREQUAL "")
+        continue()
+    endif()
+    get_filename_component(name "${source}" NAME)
+    string(MAKE_C_IDENTIFIER "${name}" symbol)
+    file(READ "${source}" text)
+    string(REPLACE "\\" "\\\\" text "${text}")
+    string(REPLACE "\"" "\\\"" text "${text}")
+    string(REPLACE "\t" "\\t" text "${text}")
+    string(REPLACE "\r" "\\r" text "${text}")
+    string(REPLACE "\n" "\\n\"\n    \"" text "${text}")
+    string(APPEND header "\nconstexpr char ${symbol}[] =\n    \"${text}\";\n")
+endforeach()
+string(APPEND header "\n}   // namespace shader_data\n")
+
+set(previous "")
+if(EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" previous)
+endif()
+if(NOT header STREQUAL previous)
+    file(WRITE "${OUTPUT}" "${header}")
+endif()
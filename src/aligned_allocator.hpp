@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>          // bad_alloc
+
+template <class T, std::size_t Alignment>
+class aligned_allocator
+{
+public:
+    typedef T value_type;
+
+    template <class U>
+    struct rebind
+    {
+        typedef aligned_allocator<U, Alignment> other;
+    };
+
+    aligned_allocator()
+    {
+    }
+
+    template <class U>
+    aligned_allocator(aligned_allocator<U, Alignment> const&)
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        // Over-allocate and keep the offset to the original block just below
+        // the aligned pointer so that deallocate can recover it.
+        std::size_t const header = sizeof(void*);
+        void* block = std::malloc(n*sizeof(T) + Alignment - 1 + header);
+        if(!block)
+            throw std::bad_alloc();
+        auto address = reinterpret_cast<std::uintptr_t>(block) + header;
+        address = (address + Alignment - 1) & ~static_cast<std::uintptr_t>(Alignment - 1);
+        reinterpret_cast<void**>(address)[-1] = block;
+        return reinterpret_cast<T*>(address);
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        if(p)
+            std::free(reinterpret_cast<void**>(p)[-1]);
+    }
+};
+
+template <class T, class U, std::size_t Alignment>
+bool operator==(aligned_allocator<T, Alignment> const&, aligned_allocator<U, Alignment> const&)
+{
+    return true;
+}
+
+template <class T, class U, std::size_t Alignment>
+bool operator!=(aligned_allocator<T, Alignment> const&, aligned_allocator<U, Alignment> const&)
+{
+    return false;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "gl.hpp"
+#include "program_cache.hpp"
+
+#include <algorithm>    // min, max
+
+// Offscreen target for the particle pass at a fraction of the window size.
+// Particles are accumulated into a float texture between begin() and end();
+// end() upsamples it bilinearly into the window. Density is low-frequency,
+// so this trades little detail for scale^2 of the fill rate.
+class density_buffer
+{
+public:
+    static float const MIN_SCALE;
+
+    explicit density_buffer(float scale) :
+        _scale(clamp_scale(scale)),
+        _width(0),
+        _height(0),
+        _target(0)
+    {
+        gl::programs().build(_program, {
+            {GL_VERTEX_SHADER, "density_composite.vert"},
+            {GL_FRAGMENT_SHADER, "density_composite.frag"}});
+        _program.use();
+        glUniform1i(_program.uniform_location("g_density"), 0);
+        GL_CHECK_ERROR();
+    }
+
+    float scale() const
+    {
+        return _scale;
+    }
+
+    // Ratio of the buffer to the window size; applied by the next begin().
+    void set_scale(float scale)
+    {
+        _scale = clamp_scale(scale);
+    }
+
+    // Redirects drawing into the cleared buffer for a window of the given
+    // size. The framebuffer bound now receives the result in end().
+    void begin(GLsizei window_width, GLsizei window_height)
+    {
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &_target);
+        GLsizei width = std::max(1, static_cast<GLsizei>(window_width*_scale + 0.5f));
+        GLsizei height = std::max(1, static_cast<GLsizei>(window_height*_scale + 0.5f));
+        if(width != _width || height != _height) {
+            _texture.image(GL_R16F, width, height, GL_RED, GL_FLOAT);
+            _texture.filter(GL_LINEAR);
+            _framebuffer.attach(GL_COLOR_ATTACHMENT0, _texture);
+            _width = width;
+            _height = height;
+        }
+        _framebuffer.bind();
+        gl::state().viewport(0, 0, width, height);
+        glClear(GL_COLOR_BUFFER_BIT);
+        GL_CHECK_ERROR();
+    }
+
+    // Upsamples the buffer over the whole window.
+    void end(GLsizei window_width, GLsizei window_height)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, static_cast<GLuint>(_target));
+        gl::state().viewport(0, 0, window_width, window_height);
+        gl::state().blend(false);
+        _texture.bind(0);
+        _program.use();
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        GL_CHECK_ERROR();
+    }
+
+private:
+    static float clamp_scale(float scale)
+    {
+        return std::max(MIN_SCALE, std::min(1.0f, scale));
+    }
+
+    float _scale;
+    GLsizei _width;
+    GLsizei _height;
+    GLint _target;
+    gl::texture _texture;
+    gl::framebuffer _framebuffer;
+    gl::program _program;
+};
+
+float const density_buffer::MIN_SCALE = 0.125f;
@@ -0,0 +1,11 @@
+#version 130
+
+uniform sampler2D g_density;
+in vec2 g_TexCoord;
+
+// The texture is linearly filtered, so this is a bilinear upsample.
+void main()
+{
+    float density = texture(g_density, g_TexCoord).r;
+    gl_FragColor = vec4(density, density, density, 1.0);
+}
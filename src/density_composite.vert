@@ -0,0 +1,12 @@
+#version 330
+
+out vec2 g_TexCoord;
+
+// Full-screen triangle, drawn without vertex attributes.
+void main()
+{
+    vec2 corner = vec2((gl_VertexID & 1) == 0 ? -1.0 : 3.0,
+        (gl_VertexID & 2) == 0 ? -1.0 : 3.0);
+    g_TexCoord = 0.5*corner + 0.5;
+    gl_Position = vec4(corner, 0.0, 1.0);
+}
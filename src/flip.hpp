@@ -0,0 +1,424 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "particles.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>    // min, max, fill, swap
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+namespace flip
+{
+
+// PIC/FLIP hybrid on a MAC grid covering [-BOUNDS, BOUNDS]^2. Particles
+// scatter velocity (and temperature, which drives buoyancy) to the grid, the
+// grid is made divergence free with a Jacobi pressure solve, and particles
+// gather back a blend of the new grid velocity (PIC) and their old velocity
+// plus the grid change (FLIP).
+unsigned const GRID_SIZE = 128;
+float const BOUNDS = 1.0f;
+float const DEFAULT_FLIP_RATIO = 0.95f;     // 0 is pure PIC, 1 is pure FLIP
+unsigned const PRESSURE_ITERATIONS = 60;
+float const BUOYANCY = 1.0f;
+float const COOLING = 0.2f;
+std::size_t const GRAIN = 4096;
+
+// Sample layout of one velocity component: width x height samples, sample
+// (i, j) at grid coordinates (i + offset_x, j + offset_y) in cell units.
+struct layout
+{
+    unsigned width;
+    unsigned height;
+    float offset_x;
+    float offset_y;
+};
+
+layout const U_LAYOUT = {GRID_SIZE + 1, GRID_SIZE, 0.0f, 0.5f};
+layout const V_LAYOUT = {GRID_SIZE, GRID_SIZE + 1, 0.5f, 0.0f};
+
+// Bilinear stencil of a point: lower-left sample and fractional offsets.
+struct stencil
+{
+    unsigned index;
+    float tx;
+    float ty;
+};
+
+inline stencil make_stencil(layout const& l, vec2 const& p)
+{
+    float const scale = GRID_SIZE/(2.0f*BOUNDS);
+    float fx = (p.x + BOUNDS)*scale - l.offset_x;
+    float fy = (p.y + BOUNDS)*scale - l.offset_y;
+    fx = std::max(0.0f, std::min(static_cast<float>(l.width - 1) - 1e-3f, fx));
+    fy = std::max(0.0f, std::min(static_cast<float>(l.height - 1) - 1e-3f, fy));
+    unsigned i = static_cast<unsigned>(fx);
+    unsigned j = static_cast<unsigned>(fy);
+    stencil s;
+    s.index = j*l.width + i;
+    s.tx = fx - i;
+    s.ty = fy - j;
+    return s;
+}
+
+// Per-thread accumulation target for the scatter.
+struct accumulator
+{
+    void resize()
+    {
+        u_momentum.assign(U_LAYOUT.width*U_LAYOUT.height, 0.0f);
+        u_weight.assign(u_momentum.size(), 0.0f);
+        v_momentum.assign(V_LAYOUT.width*V_LAYOUT.height, 0.0f);
+        v_weight.assign(v_momentum.size(), 0.0f);
+        v_temperature.assign(v_momentum.size(), 0.0f);
+    }
+
+    std::vector<float> u_momentum;
+    std::vector<float> u_weight;
+    std::vector<float> v_momentum;
+    std::vector<float> v_weight;
+    std::vector<float> v_temperature;
+};
+
+struct scatter
+{
+    typedef particles::reads<particles::position, particles::velocity, particles::temperature> reads;
+    typedef particles::writes<> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>();
+        auto velocities = view.template get<particles::velocity>();
+        auto temperatures = view.template get<particles::temperature>();
+        for(std::size_t i = begin; i != end; ++i)
+        {
+            vec2 const p = positions[i];
+            vec2 const v = velocities[i];
+
+            stencil s = make_stencil(U_LAYOUT, p);
+            splat(target.u_momentum.data(), target.u_weight.data(), nullptr,
+                U_LAYOUT.width, s, v.x, 0.0f);
+            s = make_stencil(V_LAYOUT, p);
+            splat(target.v_momentum.data(), target.v_weight.data(), target.v_temperature.data(),
+                V_LAYOUT.width, s, v.y, temperatures[i]);
+        }
+    }
+
+    static void splat(float* momentum, float* weight, float* temperature, unsigned width,
+        stencil const& s, float value, float t)
+    {
+        float const w[4] = {
+            (1.0f - s.tx)*(1.0f - s.ty), s.tx*(1.0f - s.ty),
+            (1.0f - s.tx)*s.ty, s.tx*s.ty};
+        unsigned const index[4] = {s.index, s.index + 1, s.index + width, s.index + width + 1};
+        for(unsigned k = 0; k != 4; ++k) {
+            momentum[index[k]] += w[k]*value;
+            weight[index[k]] += w[k];
+            if(temperature)
+                temperature[index[k]] += w[k]*t;
+        }
+    }
+
+    accumulator& target;
+};
+
+// Bilinear interpolation of four particles at once. The sample loads are
+// scalar (SSE has no gather) but the weights and blend are vectorised.
+inline __m128 sample4(layout const& l, float const* grid, __m128 x, __m128 y)
+{
+    float const scale = GRID_SIZE/(2.0f*BOUNDS);
+    __m128 fx = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(x, _mm_set1_ps(BOUNDS)), _mm_set1_ps(scale)),
+        _mm_set1_ps(l.offset_x));
+    __m128 fy = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(y, _mm_set1_ps(BOUNDS)), _mm_set1_ps(scale)),
+        _mm_set1_ps(l.offset_y));
+    fx = _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(_mm_set1_ps(l.width - 1 - 1e-3f), fx));
+    fy = _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(_mm_set1_ps(l.height - 1 - 1e-3f), fy));
+    __m128i ix = _mm_cvttps_epi32(fx);
+    __m128i iy = _mm_cvttps_epi32(fy);
+    __m128 tx = _mm_sub_ps(fx, _mm_cvtepi32_ps(ix));
+    __m128 ty = _mm_sub_ps(fy, _mm_cvtepi32_ps(iy));
+
+    int column[4], row[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(column), ix);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(row), iy);
+    unsigned const w = l.width;
+    unsigned const lane[4] = {row[0]*w + column[0], row[1]*w + column[1],
+        row[2]*w + column[2], row[3]*w + column[3]};
+    __m128 s00 = _mm_setr_ps(grid[lane[0]], grid[lane[1]], grid[lane[2]], grid[lane[3]]);
+    __m128 s10 = _mm_setr_ps(grid[lane[0] + 1], grid[lane[1] + 1], grid[lane[2] + 1], grid[lane[3] + 1]);
+    __m128 s01 = _mm_setr_ps(grid[lane[0] + w], grid[lane[1] + w], grid[lane[2] + w], grid[lane[3] + w]);
+    __m128 s11 = _mm_setr_ps(grid[lane[0] + w + 1], grid[lane[1] + w + 1],
+        grid[lane[2] + w + 1], grid[lane[3] + w + 1]);
+
+    __m128 bottom = _mm_add_ps(s00, _mm_mul_ps(tx, _mm_sub_ps(s10, s00)));
+    __m128 top = _mm_add_ps(s01, _mm_mul_ps(tx, _mm_sub_ps(s11, s01)));
+    return _mm_add_ps(bottom, _mm_mul_ps(ty, _mm_sub_ps(top, bottom)));
+}
+
+inline float sample(layout const& l, float const* grid, vec2 const& p)
+{
+    stencil s = make_stencil(l, p);
+    float const* g = grid + s.index;
+    float bottom = g[0] + s.tx*(g[1] - g[0]);
+    float top = g[l.width] + s.tx*(g[l.width + 1] - g[l.width]);
+    return bottom + s.ty*(top - bottom);
+}
+
+struct gather
+{
+    typedef particles::reads<> reads;
+    typedef particles::writes<particles::position, particles::velocity,
+        particles::temperature, particles::age> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>();
+        auto velocities = view.template get<particles::velocity>();
+        auto temperatures = view.template get<particles::temperature>();
+        auto ages = view.template get<particles::age>();
+
+        __m128 const ratio = _mm_set1_ps(flip_ratio);
+        __m128 const step = _mm_set1_ps(dt);
+        __m128 const lo = _mm_set1_ps(-BOUNDS);
+        __m128 const hi = _mm_set1_ps(BOUNDS);
+        std::size_t i = begin;
+        for(; i + 4 <= end; i += 4)
+        {
+            __m128 a = _mm_loadu_ps(&positions[i].x);
+            __m128 b = _mm_loadu_ps(&positions[i + 2].x);
+            __m128 x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            a = _mm_loadu_ps(&velocities[i].x);
+            b = _mm_loadu_ps(&velocities[i + 2].x);
+            __m128 vx = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 vy = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+            __m128 pic_x = sample4(U_LAYOUT, u, x, y);
+            __m128 pic_y = sample4(V_LAYOUT, v, x, y);
+            __m128 flip_x = _mm_add_ps(vx, sample4(U_LAYOUT, du, x, y));
+            __m128 flip_y = _mm_add_ps(vy, sample4(V_LAYOUT, dv, x, y));
+            vx = _mm_add_ps(pic_x, _mm_mul_ps(ratio, _mm_sub_ps(flip_x, pic_x)));
+            vy = _mm_add_ps(pic_y, _mm_mul_ps(ratio, _mm_sub_ps(flip_y, pic_y)));
+            x = _mm_max_ps(lo, _mm_min_ps(hi, _mm_add_ps(x, _mm_mul_ps(step, vx))));
+            y = _mm_max_ps(lo, _mm_min_ps(hi, _mm_add_ps(y, _mm_mul_ps(step, vy))));
+
+            _mm_storeu_ps(&positions[i].x, _mm_unpacklo_ps(x, y));
+            _mm_storeu_ps(&positions[i + 2].x, _mm_unpackhi_ps(x, y));
+            _mm_storeu_ps(&velocities[i].x, _mm_unpacklo_ps(vx, vy));
+            _mm_storeu_ps(&velocities[i + 2].x, _mm_unpackhi_ps(vx, vy));
+        }
+        for(; i != end; ++i)
+        {
+            vec2 const p = positions[i];
+            vec2 pic(sample(U_LAYOUT, u, p), sample(V_LAYOUT, v, p));
+            vec2 flip = velocities[i] + vec2(sample(U_LAYOUT, du, p), sample(V_LAYOUT, dv, p));
+            vec2 velocity = pic + flip_ratio*(flip + -pic);
+            vec2 pos = p + dt*velocity;
+            pos.x = std::max(-BOUNDS, std::min(BOUNDS, pos.x));
+            pos.y = std::max(-BOUNDS, std::min(BOUNDS, pos.y));
+            positions[i] = pos;
+            velocities[i] = velocity;
+        }
+
+        float const cooling = std::exp(-COOLING*dt);
+        for(i = begin; i != end; ++i)
+        {
+            temperatures[i] *= cooling;
+            ages[i] += dt;
+        }
+    }
+
+    float const* u;
+    float const* v;
+    float const* du;
+    float const* dv;
+    float flip_ratio;
+    float dt;
+};
+
+class solver
+{
+public:
+    struct timings
+    {
+        double scatter;     // milliseconds
+        double project;
+        double gather;
+    };
+
+    explicit solver(thread_pool& pool) :
+        _pool(pool),
+        _flip_ratio(DEFAULT_FLIP_RATIO)
+    {
+        _accumulators.resize(pool.size());
+        for(auto& a : _accumulators)
+            a.resize();
+        _u.assign(U_LAYOUT.width*U_LAYOUT.height, 0.0f);
+        _v.assign(V_LAYOUT.width*V_LAYOUT.height, 0.0f);
+        _du.assign(_u.size(), 0.0f);
+        _dv.assign(_v.size(), 0.0f);
+        _temperature.assign(_v.size(), 0.0f);
+        _pressure.assign(GRID_SIZE*GRID_SIZE, 0.0f);
+        _pressure_next.assign(_pressure.size(), 0.0f);
+        _divergence.assign(_pressure.size(), 0.0f);
+        _timings.scatter = _timings.project = _timings.gather = 0.0;
+    }
+
+    float flip_ratio() const
+    {
+        return _flip_ratio;
+    }
+
+    void set_flip_ratio(float ratio)
+    {
+        _flip_ratio = std::max(0.0f, std::min(1.0f, ratio));
+    }
+
+    timings const& last_timings() const
+    {
+        return _timings;
+    }
+
+    template <class Store>
+    void simulate(Store& store, float dt)
+    {
+        typedef std::chrono::high_resolution_clock clock;
+        auto t0 = clock::now();
+        scatter_particles(store);
+        auto t1 = clock::now();
+        _du = _u;
+        _dv = _v;
+        apply_buoyancy(dt);
+        project();
+        for(std::size_t i = 0; i != _u.size(); ++i)
+            _du[i] = _u[i] - _du[i];
+        for(std::size_t i = 0; i != _v.size(); ++i)
+            _dv[i] = _v[i] - _dv[i];
+        auto t2 = clock::now();
+        gather kernel = {_u.data(), _v.data(), _du.data(), _dv.data(), _flip_ratio, dt};
+        _pool.parallel_for(store.size(), GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            store.run(kernel, begin, end);
+        });
+        auto t3 = clock::now();
+
+        typedef std::chrono::duration<double, std::milli> ms;
+        _timings.scatter = ms(t1 - t0).count();
+        _timings.project = ms(t2 - t1).count();
+        _timings.gather = ms(t3 - t2).count();
+    }
+
+private:
+    template <class Store>
+    void scatter_particles(Store& store)
+    {
+        // Each thread splats into its own grid; the grids are then summed
+        // per sample, so no two threads ever write the same memory.
+        _pool.parallel_for(_accumulators.size(), 1, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t t = begin; t != end; ++t)
+                _accumulators[t].resize();
+        });
+        _pool.parallel_for(store.size(), GRAIN, [&](unsigned thread, std::size_t begin, std::size_t end) {
+            store.run(scatter{_accumulators[thread]}, begin, end);
+        });
+
+        reduce(_u, &accumulator::u_momentum, &accumulator::u_weight, nullptr);
+        reduce(_v, &accumulator::v_momentum, &accumulator::v_weight, &_temperature);
+    }
+
+    void reduce(std::vector<float>& grid, std::vector<float> accumulator::* momentum,
+        std::vector<float> accumulator::* weight, std::vector<float>* temperature)
+    {
+        _pool.parallel_for(grid.size(), GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t i = begin; i != end; ++i) {
+                float m = 0.0f, w = 0.0f, t = 0.0f;
+                for(auto const& a : _accumulators) {
+                    m += (a.*momentum)[i];
+                    w += (a.*weight)[i];
+                    if(temperature)
+                        t += a.v_temperature[i];
+                }
+                grid[i] = w > 0.0f ? m/w : 0.0f;
+                if(temperature)
+                    (*temperature)[i] = w > 0.0f ? t/w : 0.0f;
+            }
+        });
+    }
+
+    void apply_buoyancy(float dt)
+    {
+        for(std::size_t i = 0; i != _v.size(); ++i)
+            _v[i] += dt*BUOYANCY*_temperature[i];
+    }
+
+    void project()
+    {
+        unsigned const n = GRID_SIZE;
+        unsigned const uw = U_LAYOUT.width;
+        unsigned const vw = V_LAYOUT.width;
+
+        // Solid walls on the domain boundary.
+        for(unsigned j = 0; j != n; ++j)
+            _u[j*uw] = _u[j*uw + n] = 0.0f;
+        for(unsigned i = 0; i != n; ++i)
+            _v[i] = _v[n*vw + i] = 0.0f;
+
+        // Pressure is solved in velocity units scaled by the cell size, so
+        // that u -= p(i+1) - p(i) removes the divergence.
+        _pool.parallel_for(n, 8, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t j = begin; j != end; ++j)
+                for(unsigned i = 0; i != n; ++i)
+                    _divergence[j*n + i] = _u[j*uw + i + 1] - _u[j*uw + i]
+                        + _v[(j + 1)*vw + i] - _v[j*vw + i];
+        });
+
+        // Jacobi iterations, warm-started from the previous frame.
+        for(unsigned iteration = 0; iteration != PRESSURE_ITERATIONS; ++iteration) {
+            _pool.parallel_for(n, 8, [&](unsigned, std::size_t begin, std::size_t end) {
+                for(std::size_t j = begin; j != end; ++j) {
+                    for(unsigned i = 0; i != n; ++i) {
+                        float sum = 0.0f;
+                        float count = 0.0f;
+                        if(i != 0)     { sum += _pressure[j*n + i - 1]; count += 1.0f; }
+                        if(i != n - 1) { sum += _pressure[j*n + i + 1]; count += 1.0f; }
+                        if(j != 0)     { sum += _pressure[(j - 1)*n + i]; count += 1.0f; }
+                        if(j != n - 1) { sum += _pressure[(j + 1)*n + i]; count += 1.0f; }
+                        _pressure_next[j*n + i] = (sum - _divergence[j*n + i])/count;
+                    }
+                }
+            });
+            std::swap(_pressure, _pressure_next);
+        }
+
+        _pool.parallel_for(n, 8, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t j = begin; j != end; ++j) {
+                for(unsigned i = 1; i != n; ++i)
+                    _u[j*uw + i] -= _pressure[j*n + i] - _pressure[j*n + i - 1];
+                if(j != 0) {
+                    for(unsigned i = 0; i != n; ++i)
+                        _v[j*vw + i] -= _pressure[j*n + i] - _pressure[(j - 1)*n + i];
+                }
+            }
+        });
+    }
+
+    thread_pool& _pool;
+    float _flip_ratio;
+    std::vector<accumulator> _accumulators;
+    std::vector<float> _u;
+    std::vector<float> _v;
+    std::vector<float> _du;
+    std::vector<float> _dv;
+    std::vector<float> _temperature;
+    std::vector<float> _pressure;
+    std::vector<float> _pressure_next;
+    std::vector<float> _divergence;
+    timings _timings;
+};
+
+}   // namespace flip
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "gl.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>      // memcpy
+#include <deque>
+#include <fstream>
+#include <iomanip>      // setw, setfill
+#include <memory>       // unique_ptr
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Saves rendered frames as numbered PPM files without stalling the frame
+// loop. Each frame is read into one of RING pixel pack buffers, which
+// returns at once, and fenced. The buffer is mapped when its turn comes
+// round again, RING frames later, by which time the copy has finished; the
+// pixels are handed to a writer thread that converts and writes them. If
+// the writer falls more than QUEUE frames behind, frames are dropped and
+// counted rather than letting memory grow.
+class frame_capture
+{
+public:
+    static unsigned const RING = 3;
+    static std::size_t const QUEUE = 8;
+
+    // Files are named prefix000000.ppm, prefix000001.ppm and so on.
+    frame_capture(int width, int height, std::string const& prefix) :
+        _width(width),
+        _height(height),
+        _prefix(prefix),
+        _next(0),
+        _frame(0),
+        _dropped(0),
+        _failed(false),
+        _stop(false)
+    {
+        GLsizeiptr const size = 4*static_cast<GLsizeiptr>(width)*height;
+        for(unsigned i = 0; i != RING; ++i)
+            _slots.emplace_back(new slot(size));
+        gl::state().bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+        _writer = std::thread([this] { write_frames(); });
+    }
+
+    ~frame_capture()
+    {
+        finish();
+    }
+
+    frame_capture(frame_capture const&) = delete;
+    frame_capture& operator=(frame_capture const&) = delete;
+
+    int width() const
+    {
+        return _width;
+    }
+
+    int height() const
+    {
+        return _height;
+    }
+
+    // Collects the frames still in flight and waits for all of them to be
+    // written. Nothing can be captured afterwards.
+    void finish()
+    {
+        if(!_writer.joinable())
+            return;
+        for(unsigned i = 0; i != RING; ++i) {
+            collect(*_slots[_next]);
+            _next = (_next + 1) % RING;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _writer.join();
+    }
+
+    // Starts reading the bound read framebuffer, which must be as large as
+    // the capture.
+    void capture()
+    {
+        slot& current = *_slots[_next];
+        collect(current);
+        current.buffer.bind(GL_PIXEL_PACK_BUFFER);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        // BGRA is the layout drivers copy without swizzling.
+        glReadPixels(0, 0, _width, _height, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+        GL_CHECK_ERROR();
+        gl::state().bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+        current.fence.reset(new gl::fence);
+        current.frame = _frame++;
+        _next = (_next + 1) % RING;
+    }
+
+    // Frames captured so far, including dropped ones.
+    unsigned frames() const
+    {
+        return _frame;
+    }
+
+    unsigned dropped() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped;
+    }
+
+    bool failed() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _failed;
+    }
+
+private:
+    struct slot
+    {
+        explicit slot(GLsizeiptr size) :
+            buffer(GL_PIXEL_PACK_BUFFER, static_cast<GLsizei>(size), GL_STREAM_READ),
+            size(size),
+            frame(0)
+        {
+        }
+
+        gl::buffer buffer;
+        GLsizeiptr size;
+        std::unique_ptr<gl::fence> fence;   // set while a read is in flight
+        unsigned frame;
+    };
+
+    struct pending
+    {
+        unsigned frame;
+        std::vector<unsigned char> pixels;  // BGRA, bottom row first
+    };
+
+    // Hands the slot's frame to the writer, if it holds one.
+    void collect(slot& s)
+    {
+        if(!s.fence)
+            return;
+        s.fence->wait(GL_TIMEOUT_IGNORED);
+        s.fence.reset();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(_queue.size() >= QUEUE) {
+            ++_dropped;
+            return;
+        }
+        std::vector<unsigned char> pixels;
+        if(!_free.empty()) {
+            pixels.swap(_free.back());
+            _free.pop_back();
+        }
+        lock.unlock();
+
+        pixels.resize(static_cast<std::size_t>(s.size));
+        void const* data = s.buffer.map(GL_PIXEL_PACK_BUFFER, 0, s.size, GL_MAP_READ_BIT);
+        std::memcpy(pixels.data(), data, pixels.size());
+        s.buffer.unmap(GL_PIXEL_PACK_BUFFER);
+        gl::state().bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        lock.lock();
+        _queue.push_back(pending());
+        _queue.back().frame = s.frame;
+        _queue.back().pixels.swap(pixels);
+        lock.unlock();
+        _wake.notify_one();
+    }
+
+    void write_frames()
+    {
+        std::vector<unsigned char> row(3*_width);
+        std::unique_lock<std::mutex> lock(_mutex);
+        for(;;) {
+            _wake.wait(lock, [this] { return _stop || !_queue.empty(); });
+            if(_queue.empty())
+                return;
+            pending p;
+            p.frame = _queue.front().frame;
+            p.pixels.swap(_queue.front().pixels);
+            _queue.pop_front();
+            lock.unlock();
+
+            std::ostringstream name;
+            name << _prefix << std::setw(6) << std::setfill('0') << p.frame << ".ppm";
+            std::ofstream out(name.str().c_str(), std::ios::binary);
+            out << "P6\n" << _width << " " << _height << "\n255\n";
+            for(int y = _height; y-- != 0;) {
+                unsigned char const* bgra = &p.pixels[4*static_cast<std::size_t>(_width)*y];
+                for(int x = 0; x != _width; ++x) {
+                    row[3*x] = bgra[4*x + 2];
+                    row[3*x + 1] = bgra[4*x + 1];
+                    row[3*x + 2] = bgra[4*x];
+                }
+                out.write(reinterpret_cast<char const*>(row.data()), row.size());
+            }
+            bool const ok = static_cast<bool>(out);
+
+            lock.lock();
+            if(!ok)
+                _failed = true;
+            _free.push_back(std::vector<unsigned char>());
+            _free.back().swap(p.pixels);
+        }
+    }
+
+    int _width;
+    int _height;
+    std::string _prefix;
+    std::vector<std::unique_ptr<slot>> _slots;
+    unsigned _next;
+    unsigned _frame;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<pending> _queue;
+    std::vector<std::vector<unsigned char>> _free;  // recycled pixel arrays
+    unsigned _dropped;
+    bool _failed;
+    bool _stop;
+    std::thread _writer;
+};
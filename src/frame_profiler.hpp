@@ -0,0 +1,142 @@
+#pragma once
+
+#include "gpu_timer.hpp"
+#include "latency_histogram.hpp"
+#include "timer.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <initializer_list>
+#include <memory>       // unique_ptr
+#include <ostream>
+#include <vector>
+
+// Averages the CPU time of each phase of the frame loop and, through
+// gl::gpu_timer, the GPU time of each render pass. CPU phases and GPU passes
+// are marked independently, in order, since they overlap: the CPU is
+// usually several passes ahead. A disabled profiler skips the averages and
+// the GPU timer.
+//
+// Whether enabled or not, the time of every frame and every CPU phase also
+// goes into a latency_histogram, since averages hide the occasional long
+// frame that users notice. report_percentiles() prints their tails. Times
+// come from the frame loop's timer: VS2013's high_resolution_clock is the
+// system clock, too coarse for phases well under a millisecond.
+class frame_profiler
+{
+public:
+    frame_profiler(class timer const& timer, bool enabled, std::initializer_list<char const*> phases,
+        std::initializer_list<char const*> passes) :
+        _timer(timer),
+        _enabled(enabled),
+        _phases(phases),
+        _passes(passes),
+        _cpu_totals(_phases.size(), 0.0),
+        _phase(0),
+        _frames(0)
+    {
+        for(std::size_t i = 0; i != _phases.size(); ++i)
+            _phase_times.emplace_back(new latency_histogram);
+        if(enabled)
+            _gpu.reset(new gl::gpu_timer(static_cast<unsigned>(passes.size())));
+    }
+
+    bool enabled() const
+    {
+        return _enabled;
+    }
+
+    void begin_frame()
+    {
+        if(_enabled)
+            _gpu->begin_frame();
+        _phase = 0;
+        _start = _timer.get();
+        _frame_start = _start;
+    }
+
+    // Ends the current CPU phase and starts the next.
+    void end_phase()
+    {
+        if(_phase == _phases.size())
+            return;
+        timer::duration now = _timer.get();
+        _phase_times[_phase]->record((now - _start).count());
+        if(_enabled)
+            _cpu_totals[_phase] += milliseconds(now - _start).count();
+        ++_phase;
+        _start = now;
+    }
+
+    // Ends the current GPU pass and starts the next.
+    void end_pass()
+    {
+        if(_enabled)
+            _gpu->end_pass();
+    }
+
+    void end_frame()
+    {
+        _frame_times.record((_timer.get() - _frame_start).count());
+        if(_enabled)
+            ++_frames;
+    }
+
+    unsigned frames() const
+    {
+        return _frames;
+    }
+
+    // Prints the averages since the last report and starts over.
+    void report(std::ostream& out)
+    {
+        if(!_enabled || _frames == 0)
+            return;
+        out << "cpu:";
+        for(std::size_t i = 0; i != _phases.size(); ++i)
+            out << " " << _phases[i] << " " << _cpu_totals[i]/_frames << " ms";
+        if(_gpu->supported()) {
+            out << "; gpu:";
+            for(std::size_t i = 0; i != _passes.size(); ++i)
+                out << " " << _passes[i] << " " << _gpu->milliseconds(static_cast<unsigned>(i)) << " ms";
+        }
+        out << " (" << _frames << " frames)" << std::endl;
+        _cpu_totals.assign(_phases.size(), 0.0);
+        _frames = 0;
+        _gpu->reset();
+    }
+
+    // Prints the median, tail percentiles and maximum of the frame time and
+    // of each phase over all frames so far.
+    void report_percentiles(std::ostream& out) const
+    {
+        if(_frame_times.count() == 0)
+            return;
+        print_percentiles(out, "frame", _frame_times);
+        for(std::size_t i = 0; i != _phases.size(); ++i)
+            print_percentiles(out, _phases[i], *_phase_times[i]);
+    }
+
+private:
+    typedef std::chrono::duration<double, std::milli> milliseconds;
+
+    static void print_percentiles(std::ostream& out, char const* name, latency_histogram const& times)
+    {
+        out << name << ": p50 " << times.percentile(0.5)*1e-6 << " ms, p99 " << times.percentile(0.99)*1e-6
+            << " ms, p99.9 " << times.percentile(0.999)*1e-6 << " ms, max " << times.max()*1e-6 << " ms ("
+            << times.count() << " samples)" << std::endl;
+    }
+
+    class timer const& _timer;
+    bool _enabled;
+    std::vector<char const*> _phases;
+    std::vector<char const*> _passes;
+    std::unique_ptr<gl::gpu_timer> _gpu;
+    std::vector<double> _cpu_totals;
+    std::vector<std::unique_ptr<latency_histogram>> _phase_times;
+    latency_histogram _frame_times;
+    std::size_t _phase;
+    timer::duration _start;
+    timer::duration _frame_start;
+    unsigned _frames;
+};
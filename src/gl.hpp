@@ -1,24 +1,50 @@
+#pragma once
+
+#include "vec2.hpp"
+
 #include <stdexcept>
 #include <vector>
 #include <string>
 #include <fstream>      // ifstream
+#include <cstring>      // strlen
 #include <type_traits>  // alignment_of
+#include <cstddef>      // size_t, offsetof
 #include <algorithm>    // move, swap
+#include <initializer_list>
+#include <iostream>     // cerr
+#include <sstream>      // ostringstream
 
 #define GLEW_STATIC
-#include <GL/glew.h>
+#include <GL/glew.h>       // declares GL 1.1 too, so no <GL/gl.h>
 #include <GLFW/glfw3.h>
-#include <gl/GL.h>
+
+// Strict error checking polls glGetError after every wrapped call and
+// throws with the source location. It is on in debug builds; release builds
+// rely on the debug message callback instead. Define GL_STRICT_ERRORS to 0
+// or 1 to override.
+#ifndef GL_STRICT_ERRORS
+#ifdef NDEBUG
+#define GL_STRICT_ERRORS 0
+#else
+#define GL_STRICT_ERRORS 1
+#endif
+#endif
+
+#define GL_CHECK_ERROR() ::gl::check_error(__FILE__, __LINE__)
 
 namespace gl
 {
 
+bool const strict_errors = GL_STRICT_ERRORS != 0;
+
 class error : public std::runtime_error
 {
 public:
-    error(GLenum code) :
-        runtime_error("OpenGL call failed"),
-        _code(code)
+    error(GLenum code, char const* file = nullptr, int line = 0) :
+        runtime_error(describe(code, file, line)),
+        _code(code),
+        _file(file),
+        _line(line)
     {
     }
 
@@ -27,8 +53,30 @@ public:
         return _code;
     }
 
+    // Where the error was detected, if known.
+    char const* file() const
+    {
+        return _file;
+    }
+
+    int line() const
+    {
+        return _line;
+    }
+
 private:
+    static std::string describe(GLenum code, char const* file, int line)
+    {
+        std::ostringstream message;
+        message << "OpenGL call failed (0x" << std::hex << code << std::dec << ")";
+        if(file)
+            message << " at " << file << ":" << line;
+        return message.str();
+    }
+
     GLenum _code;
+    char const* _file;
+    int _line;
 };
 
 class compilation_error : public std::runtime_error
@@ -49,11 +97,14 @@ private:
     std::string _log;
 };
 
-void check_error()
+// Use through GL_CHECK_ERROR(). Compiles to nothing without strict errors.
+void check_error(char const* file, int line)
 {
+    if(!strict_errors)
+        return;
     GLenum err = glGetError();
     if(err != GL_NO_ERROR)
-        throw error(err);
+        throw error(err, file, line);
 }
 
 void check_error(GLuint result)
@@ -68,6 +119,193 @@ void check_error(void const* result)
         throw error(glGetError());
 }
 
+void APIENTRY debug_message_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+    GLsizei length, GLchar const* message, void const*)
+{
+    std::cerr << "GL debug message 0x" << std::hex << id << std::dec
+        << " (source 0x" << std::hex << source << ", type 0x" << type
+        << ", severity 0x" << severity << std::dec << "): "
+        << std::string(message, length >= 0 ? static_cast<std::size_t>(length) : std::strlen(message))
+        << std::endl;
+}
+
+// Reports errors and warnings through KHR_debug if available. With strict
+// errors the messages are synchronous, so a breakpoint in the callback
+// shows the failing call. Returns whether the callback was installed.
+bool enable_debug_output()
+{
+    if(!GLEW_KHR_debug && !GLEW_VERSION_4_3)
+        return false;
+    glEnable(GL_DEBUG_OUTPUT);
+    if(strict_errors)
+        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    glDebugMessageCallback(debug_message_callback, nullptr);
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, nullptr, GL_FALSE);
+    GL_CHECK_ERROR();
+    return true;
+}
+
+// Shadow copy of the context state that the wrappers change most often.
+// Calls that would not change anything are skipped. Everything that binds
+// buffers, programs or vertex arrays, or changes blending or the viewport,
+// must go through here or call invalidate() afterwards.
+class state_cache {
+public:
+    state_cache()
+    {
+        invalidate();
+    }
+
+    // Forgets everything, e.g. after raw GL calls or a context change.
+    void invalidate()
+    {
+        _bindings.clear();
+        _program = UNKNOWN;
+        _vertex_array = UNKNOWN;
+        _blend = UNKNOWN;
+        _blend_src = _blend_dst = UNKNOWN;
+        _viewport[0] = _viewport[1] = _viewport[2] = _viewport[3] = -1;
+    }
+
+    void bind_buffer(GLenum target, GLuint name)
+    {
+        if(update(target, GENERIC, name))
+            glBindBuffer(target, name);
+    }
+
+    // Also replaces the generic binding of target, like GL does.
+    void bind_buffer_base(GLenum target, GLuint index, GLuint name)
+    {
+        if(update(target, index, name))
+            glBindBufferBase(target, index, name);
+        update(target, GENERIC, name);
+    }
+
+    // Deleting a buffer unbinds it everywhere, and its name may be reused.
+    void forget_buffer(GLuint name)
+    {
+        for(auto& binding : _bindings)
+            if(binding.name == name)
+                binding.name = UNKNOWN;
+    }
+
+    void use_program(GLuint program)
+    {
+        if(_program != program) {
+            glUseProgram(program);
+            _program = program;
+        }
+    }
+
+    void forget_program(GLuint program)
+    {
+        if(_program == program)
+            _program = UNKNOWN;
+    }
+
+    void bind_vertex_array(GLuint vertex_array)
+    {
+        if(_vertex_array != vertex_array) {
+            glBindVertexArray(vertex_array);
+            _vertex_array = vertex_array;
+        }
+    }
+
+    void forget_vertex_array(GLuint vertex_array)
+    {
+        if(_vertex_array == vertex_array)
+            _vertex_array = UNKNOWN;
+    }
+
+    void blend(bool enabled)
+    {
+        GLuint const value = enabled ? 1 : 0;
+        if(_blend != value) {
+            if(enabled)
+                glEnable(GL_BLEND);
+            else
+                glDisable(GL_BLEND);
+            _blend = value;
+        }
+    }
+
+    void blend_func(GLenum src, GLenum dst)
+    {
+        if(_blend_src != src || _blend_dst != dst) {
+            glBlendFunc(src, dst);
+            _blend_src = src;
+            _blend_dst = dst;
+        }
+    }
+
+    void viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+    {
+        if(_viewport[0] != x || _viewport[1] != y || _viewport[2] != width || _viewport[3] != height) {
+            glViewport(x, y, width, height);
+            _viewport[0] = x;
+            _viewport[1] = y;
+            _viewport[2] = width;
+            _viewport[3] = height;
+        }
+    }
+
+    GLint viewport_width()
+    {
+        if(_viewport[2] < 0)
+            glGetIntegerv(GL_VIEWPORT, _viewport);
+        return _viewport[2];
+    }
+
+    GLint viewport_height()
+    {
+        if(_viewport[3] < 0)
+            glGetIntegerv(GL_VIEWPORT, _viewport);
+        return _viewport[3];
+    }
+
+private:
+    static GLuint const UNKNOWN = ~0u;
+    static GLuint const GENERIC = ~0u;
+
+    struct binding
+    {
+        GLenum target;
+        GLuint index;
+        GLuint name;
+    };
+
+    // Returns whether the binding changed.
+    bool update(GLenum target, GLuint index, GLuint name)
+    {
+        for(auto& binding : _bindings) {
+            if(binding.target == target && binding.index == index) {
+                if(binding.name == name)
+                    return false;
+                binding.name = name;
+                return true;
+            }
+        }
+        _bindings.push_back(binding{target, index, name});
+        return true;
+    }
+
+    // Few targets are in use, so a linear search beats a map.
+    std::vector<binding> _bindings;
+    GLuint _program;
+    GLuint _vertex_array;
+    GLuint _blend;
+    GLenum _blend_src;
+    GLenum _blend_dst;
+    GLint _viewport[4];
+};
+
+// The cache of the one context the application uses.
+state_cache& state()
+{
+    static state_cache cache;
+    return cache;
+}
+
 class glfw_context {
 public:
     glfw_context()
@@ -86,17 +324,19 @@ public:
     buffer(GLenum target, GLsizei size, GLenum usage = GL_STATIC_DRAW)
     {
         glGenBuffers(1, &_name);
-        check_error();
-        glBindBuffer(target, _name);
-        check_error();
+        GL_CHECK_ERROR();
+        state().bind_buffer(target, _name);
+        GL_CHECK_ERROR();
         glBufferData(target, size, nullptr, usage);
-        check_error();
+        GL_CHECK_ERROR();
     }
 
     ~buffer()
     {
-        if(_name)
+        if(_name) {
+            state().forget_buffer(_name);
             glDeleteBuffers(1, &_name);
+        }
     }
 
     buffer(buffer const&) = delete;
@@ -120,14 +360,94 @@ public:
 
     void bind(GLenum target)
     {
-        glBindBuffer(target, _name);
-        check_error();
+        state().bind_buffer(target, _name);
+        GL_CHECK_ERROR();
+    }
+
+    void bind_base(GLenum target, GLuint index)
+    {
+        state().bind_buffer_base(target, index, _name);
+        GL_CHECK_ERROR();
+    }
+
+    void sub_data(GLenum target, GLintptr offset, GLsizeiptr size, void const* data)
+    {
+        bind(target);
+        glBufferSubData(target, offset, size, data);
+        GL_CHECK_ERROR();
+    }
+
+    void get_sub_data(GLenum target, GLintptr offset, GLsizeiptr size, void* data)
+    {
+        bind(target);
+        glGetBufferSubData(target, offset, size, data);
+        GL_CHECK_ERROR();
+    }
+
+    // glMapBufferRange; pair with unmap() on the same target.
+    void* map(GLenum target, GLintptr offset, GLsizeiptr size, GLbitfield access)
+    {
+        bind(target);
+        void* p = glMapBufferRange(target, offset, size, access);
+        check_error(p);
+        return p;
+    }
+
+    void unmap(GLenum target)
+    {
+        bind(target);
+        glUnmapBuffer(target);
+        GL_CHECK_ERROR();
     }
 
 private:
     GLuint _name;
 };
 
+// A sync object signalled when the GPU has executed every command issued
+// before it.
+class fence {
+public:
+    fence() :
+        _sync(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0))
+    {
+        check_error(_sync);
+    }
+
+    ~fence()
+    {
+        if(_sync)
+            glDeleteSync(_sync);
+    }
+
+    fence(fence const&) = delete;
+    fence& operator=(fence const&) = delete;
+
+    fence(fence&& other) :
+        _sync(other._sync)
+    {
+        other._sync = nullptr;
+    }
+    fence& operator=(fence&& other)
+    {
+        std::swap(_sync, other._sync);
+        return *this;
+    }
+
+    // Waits up to timeout nanoseconds, flushing so that the fence is sure
+    // to be reached; returns whether it was.
+    bool wait(GLuint64 timeout)
+    {
+        GLenum result = glClientWaitSync(_sync, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if(result == GL_WAIT_FAILED)
+            throw error(glGetError(), __FILE__, __LINE__);
+        return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+    }
+
+private:
+    GLsync _sync;
+};
+
 template <class Vertex>
 class vertex_buffer_map;
 
@@ -165,8 +485,26 @@ public:
         _buffer.bind(GL_ARRAY_BUFFER);
     }
 
+    // Replaces vertices [first, first + count).
+    void sub_data(GLsizei first, GLsizei count, Vertex const* vertices)
+    {
+        static_assert(stride == sizeof(Vertex), "vertices are not tightly packed");
+        _buffer.sub_data(GL_ARRAY_BUFFER, first*stride, count*stride, vertices);
+    }
+
+    // Reads vertices [first, first + count) back.
+    void get_sub_data(GLsizei first, GLsizei count, Vertex* vertices)
+    {
+        static_assert(stride == sizeof(Vertex), "vertices are not tightly packed");
+        _buffer.get_sub_data(GL_ARRAY_BUFFER, first*stride, count*stride, vertices);
+    }
+
     vertex_buffer_map<Vertex> map();
 
+    // Maps vertices [first, first + count) with glMapBufferRange access
+    // bits, e.g. GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT.
+    vertex_buffer_map<Vertex> map(GLsizei first, GLsizei count, GLbitfield access);
+
 private:
     buffer _buffer;
 };
@@ -176,7 +514,13 @@ class vertex_buffer_map {
 public:
     vertex_buffer_map(vertex_buffer<Vertex>& buffer, GLenum access = GL_WRITE_ONLY) :
         _p(map_buffer(buffer, access)),
-        _buffer(buffer)
+        _buffer(&buffer)
+    {
+    }
+
+    vertex_buffer_map(vertex_buffer<Vertex>& buffer, GLsizei first, GLsizei count, GLbitfield access) :
+        _p(map_buffer_range(buffer, first, count, access)),
+        _buffer(&buffer)
     {
     }
 
@@ -184,10 +528,9 @@ public:
     {
         if(_p)
         {
-            glBindBuffer(GL_ARRAY_BUFFER, _buffer.get());
-            check_error();
+            _buffer->bind();
             glUnmapBuffer(GL_ARRAY_BUFFER);
-            check_error();
+            GL_CHECK_ERROR();
         }
     }
 
@@ -195,7 +538,8 @@ public:
     vertex_buffer_map& operator=(vertex_buffer_map const&) = delete;
 
     vertex_buffer_map(vertex_buffer_map&& other) :
-        _p(other._p)
+        _p(other._p),
+        _buffer(other._buffer)
     {
         other._p = nullptr;
     }
@@ -203,6 +547,7 @@ public:
     vertex_buffer_map& operator=(vertex_buffer_map&& other)
     {
         std::swap(_p, other._p);
+        std::swap(_buffer, other._buffer);
         return *this;
     }
 
@@ -229,14 +574,24 @@ public:
 private:
     static Vertex* map_buffer(vertex_buffer<Vertex>& buffer, GLenum access)
     {
-        glBindBuffer(GL_ARRAY_BUFFER, buffer.get());
-        check_error();
+        buffer.bind();
         auto p = static_cast<Vertex*>(glMapBuffer(GL_ARRAY_BUFFER, access));
         check_error(p);
         return p;
     }
+
+    static Vertex* map_buffer_range(vertex_buffer<Vertex>& buffer, GLsizei first, GLsizei count, GLbitfield access)
+    {
+        typedef vertex_buffer<Vertex> buffer_type;
+        buffer.bind();
+        auto p = static_cast<Vertex*>(glMapBufferRange(GL_ARRAY_BUFFER, first*buffer_type::stride,
+            count*buffer_type::stride, access));
+        check_error(p);
+        return p;
+    }
+
     Vertex* _p;
-    vertex_buffer<Vertex>& _buffer;
+    vertex_buffer<Vertex>* _buffer;
 };
 
 template <class Vertex>
@@ -245,6 +600,361 @@ vertex_buffer_map<Vertex> vertex_buffer<Vertex>::map()
     return vertex_buffer_map<Vertex>(*this);
 }
 
+template <class Vertex>
+vertex_buffer_map<Vertex> vertex_buffer<Vertex>::map(GLsizei first, GLsizei count, GLbitfield access)
+{
+    return vertex_buffer_map<Vertex>(*this, first, count, access);
+}
+
+// How a vertex attribute is read: Components values of Type, mapped to
+// [0, 1] or [-1, 1] if Normalized, and passed to the shader as integers
+// rather than floats if Integer.
+template <GLint Components, GLenum Type, GLboolean Normalized, bool Integer = false>
+struct attribute_format {
+    static_assert(Components >= 1 && Components <= 4, "attributes have 1-4 components");
+
+    static GLint const components = Components;
+    static GLenum const type = Type;
+    static GLboolean const normalized = Normalized;
+    static bool const integer = Integer;
+};
+
+// Component count, type and normalization of a vertex attribute of type T.
+// Only the types specialised below can be attributes, so a member of any
+// other type fails to compile instead of being read as floats; specialise
+// for new member types.
+template <class T>
+struct attribute_traits {
+    static_assert(sizeof(T) == 0, "no attribute_traits for this member type");
+};
+
+template <>
+struct attribute_traits<GLfloat> : attribute_format<1, GL_FLOAT, GL_FALSE> {
+};
+
+template <std::size_t N>
+struct attribute_traits<GLfloat[N]> : attribute_format<N, GL_FLOAT, GL_FALSE> {
+};
+
+template <>
+struct attribute_traits<vec2> : attribute_format<2, GL_FLOAT, GL_FALSE> {
+};
+
+// Integers reach the shader unconverted, as int or ivecN.
+template <>
+struct attribute_traits<GLint> : attribute_format<1, GL_INT, GL_FALSE, true> {
+};
+
+template <std::size_t N>
+struct attribute_traits<GLint[N]> : attribute_format<N, GL_INT, GL_FALSE, true> {
+};
+
+template <>
+struct attribute_traits<GLuint> : attribute_format<1, GL_UNSIGNED_INT, GL_FALSE, true> {
+};
+
+template <std::size_t N>
+struct attribute_traits<GLuint[N]> : attribute_format<N, GL_UNSIGNED_INT, GL_FALSE, true> {
+};
+
+// Four bytes mapped to [0, 1], e.g. an RGBA8 color.
+template <>
+struct attribute_traits<GLubyte[4]> : attribute_format<4, GL_UNSIGNED_BYTE, GL_TRUE> {
+};
+
+// A member of type T at byte offset Offset, e.g.
+// attribute<vec2, offsetof(vertex, position)>.
+template <class T, std::size_t Offset, class Traits = attribute_traits<T>>
+struct attribute {
+    typedef T value_type;
+    static std::size_t const offset = Offset;
+    static GLint const components = Traits::components;
+    static GLenum const type = Traits::type;
+    static GLboolean const normalized = Traits::normalized;
+    static bool const integer = Traits::integer;
+};
+
+// Attributes bound to consecutive locations, starting at the first one.
+template <class... Attributes>
+struct attributes;
+
+template <>
+struct attributes<> {
+    static GLuint const count = 0;
+    static std::size_t const end = 0;
+
+    static void apply(GLuint, GLsizei)
+    {
+    }
+};
+
+template <class Attribute, class... Rest>
+struct attributes<Attribute, Rest...> {
+    static GLuint const count = 1 + attributes<Rest...>::count;
+    // Byte just past the last attribute; must fit in the vertex.
+    static std::size_t const end = Attribute::offset + sizeof(typename Attribute::value_type) > attributes<Rest...>::end
+        ? Attribute::offset + sizeof(typename Attribute::value_type) : attributes<Rest...>::end;
+
+    static void apply(GLuint location, GLsizei stride)
+    {
+        glEnableVertexAttribArray(location);
+        GL_CHECK_ERROR();
+        if(Attribute::integer)
+            glVertexAttribIPointer(location, Attribute::components, Attribute::type,
+                stride, reinterpret_cast<void const*>(Attribute::offset));
+        else
+            glVertexAttribPointer(location, Attribute::components, Attribute::type, Attribute::normalized,
+                stride, reinterpret_cast<void const*>(Attribute::offset));
+        GL_CHECK_ERROR();
+        attributes<Rest...>::apply(location + 1, stride);
+    }
+};
+
+// Describes the attributes of Vertex. Specialise by deriving from
+// attributes<...>, one attribute per member in shader location order.
+template <class Vertex>
+struct vertex_layout;
+
+class vertex_array {
+public:
+    vertex_array()
+    {
+        glGenVertexArrays(1, &_name);
+        GL_CHECK_ERROR();
+    }
+
+    ~vertex_array()
+    {
+        if(_name) {
+            state().forget_vertex_array(_name);
+            glDeleteVertexArrays(1, &_name);
+        }
+    }
+
+    vertex_array(vertex_array const&) = delete;
+    vertex_array& operator=(vertex_array const&) = delete;
+
+    vertex_array(vertex_array&& other) :
+        _name(other._name)
+    {
+        other._name = 0;
+    }
+    vertex_array& operator=(vertex_array&& other)
+    {
+        std::swap(_name, other._name);
+        return *this;
+    }
+
+    GLuint get() const
+    {
+        return _name;
+    }
+
+    void bind()
+    {
+        state().bind_vertex_array(_name);
+        GL_CHECK_ERROR();
+    }
+
+    // Records the layout of Vertex, read from buffer, starting at attribute
+    // location first. Leaves this array bound.
+    template <class Vertex>
+    void attach(vertex_buffer<Vertex>& buffer, GLuint first = 0)
+    {
+        typedef vertex_layout<Vertex> layout;
+        static_assert(layout::end <= sizeof(Vertex), "vertex layout does not fit the vertex");
+        bind();
+        buffer.bind();
+        layout::apply(first, static_cast<GLsizei>(vertex_buffer<Vertex>::stride));
+    }
+
+private:
+    GLuint _name;
+};
+
+template <class T>
+class shader_storage_buffer {
+public:
+    shader_storage_buffer(GLsizei size, GLenum usage = GL_DYNAMIC_COPY) :
+        _buffer(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizei>(size*sizeof(T)), usage),
+        _size(size)
+    {
+    }
+
+    shader_storage_buffer(shader_storage_buffer const&) = delete;
+    shader_storage_buffer& operator=(shader_storage_buffer const&) = delete;
+
+    shader_storage_buffer(shader_storage_buffer&& other) :
+        _buffer(std::move(other._buffer)),
+        _size(other._size)
+    {
+    }
+    shader_storage_buffer& operator=(shader_storage_buffer&& other)
+    {
+        _buffer = std::move(other._buffer);
+        std::swap(_size, other._size);
+        return *this;
+    }
+
+    GLuint get() const
+    {
+        return _buffer.get();
+    }
+
+    GLsizei size() const
+    {
+        return _size;
+    }
+
+    void bind_base(GLuint index)
+    {
+        _buffer.bind_base(GL_SHADER_STORAGE_BUFFER, index);
+    }
+
+    // Binds the same storage to another target, e.g. GL_ARRAY_BUFFER to read
+    // it as vertex input.
+    void bind(GLenum target)
+    {
+        _buffer.bind(target);
+    }
+
+    void upload(T const* data, GLsizei count, GLsizei first = 0)
+    {
+        _buffer.sub_data(GL_SHADER_STORAGE_BUFFER, first*sizeof(T), count*sizeof(T), data);
+    }
+
+    void download(T* data, GLsizei count, GLsizei first = 0)
+    {
+        _buffer.get_sub_data(GL_SHADER_STORAGE_BUFFER, first*sizeof(T), count*sizeof(T), data);
+    }
+
+private:
+    buffer _buffer;
+    GLsizei _size;
+};
+
+class texture {
+public:
+    texture()
+    {
+        glGenTextures(1, &_name);
+        GL_CHECK_ERROR();
+    }
+
+    ~texture()
+    {
+        if(_name)
+            glDeleteTextures(1, &_name);
+    }
+
+    texture(texture const&) = delete;
+    texture& operator=(texture const&) = delete;
+
+    texture(texture&& other) :
+        _name(other._name)
+    {
+        other._name = 0;
+    }
+    texture& operator=(texture&& other)
+    {
+        std::swap(_name, other._name);
+        return *this;
+    }
+
+    GLuint get() const
+    {
+        return _name;
+    }
+
+    void bind(GLuint unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, _name);
+        GL_CHECK_ERROR();
+    }
+
+    // (Re)allocates level 0 without mipmaps, nearest filtered and clamped.
+    // Leaves the texture bound to unit 0.
+    void image(GLenum internal_format, GLsizei width, GLsizei height, GLenum format, GLenum type)
+    {
+        bind(0);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GL_CHECK_ERROR();
+    }
+
+    // Sets the minification and magnification filter, e.g. GL_LINEAR.
+    // Leaves the texture bound to unit 0.
+    void filter(GLenum filter)
+    {
+        bind(0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        GL_CHECK_ERROR();
+    }
+
+private:
+    GLuint _name;
+};
+
+class framebuffer {
+public:
+    framebuffer()
+    {
+        glGenFramebuffers(1, &_name);
+        GL_CHECK_ERROR();
+    }
+
+    ~framebuffer()
+    {
+        if(_name)
+            glDeleteFramebuffers(1, &_name);
+    }
+
+    framebuffer(framebuffer const&) = delete;
+    framebuffer& operator=(framebuffer const&) = delete;
+
+    framebuffer(framebuffer&& other) :
+        _name(other._name)
+    {
+        other._name = 0;
+    }
+    framebuffer& operator=(framebuffer&& other)
+    {
+        std::swap(_name, other._name);
+        return *this;
+    }
+
+    GLuint get() const
+    {
+        return _name;
+    }
+
+    void bind()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, _name);
+        GL_CHECK_ERROR();
+    }
+
+    // Attaches level 0 of texture and checks completeness. Leaves this
+    // framebuffer bound.
+    void attach(GLenum attachment, texture const& texture)
+    {
+        bind();
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture.get(), 0);
+        GL_CHECK_ERROR();
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if(status != GL_FRAMEBUFFER_COMPLETE)
+            throw error(status, __FILE__, __LINE__);
+    }
+
+private:
+    GLuint _name;
+};
+
 class shader_object {
 public:
     shader_object(GLenum type) :
@@ -288,16 +998,16 @@ public:
         _object(type)
     {
         glShaderSource(_object.get(), 1, &source, &length);
-        check_error();
+        GL_CHECK_ERROR();
         glCompileShader(_object.get());
-        check_error();
+        GL_CHECK_ERROR();
         GLint compiled;
         glGetShaderiv(_object.get(), GL_COMPILE_STATUS, &compiled);
-        check_error();
+        GL_CHECK_ERROR();
         if(!compiled) {
             GLint length;
             glGetShaderiv(_object.get(), GL_INFO_LOG_LENGTH, &length);
-            check_error();
+            GL_CHECK_ERROR();
             std::vector<GLchar> infolog(length);
             glGetShaderInfoLog(_object.get(), length, nullptr, infolog.data());
             throw compilation_error(std::string(begin(infolog), end(infolog)));
@@ -315,6 +1025,7 @@ public:
     shader& operator=(shader&& other)
     {
         _object = std::move(other._object);
+        return *this;
     }
 
     GLuint get() const
@@ -335,60 +1046,146 @@ public:
     }
     ~program()
     {
+        state().forget_program(_program);
         glDeleteProgram(_program);
     }
 
     program& attach(shader const& shader)
     {
         glAttachShader(_program, shader.get());
-        check_error();
+        GL_CHECK_ERROR();
+        return *this;
+    }
+
+    // Must be called before link().
+    program& transform_feedback_varyings(std::initializer_list<GLchar const*> names, GLenum buffer_mode)
+    {
+        glTransformFeedbackVaryings(_program, static_cast<GLsizei>(names.size()), names.begin(), buffer_mode);
+        GL_CHECK_ERROR();
+        return *this;
+    }
+
+    // Must be called before link() for binary() to work reliably.
+    program& binary_retrievable()
+    {
+        glProgramParameteri(_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        GL_CHECK_ERROR();
         return *this;
     }
 
     void link()
     {
         glLinkProgram(_program);
-        check_error();
-        GLint linked;
-        glGetProgramiv(_program, GL_LINK_STATUS, &linked);
-        check_error();
-        if(!linked) {
+        GL_CHECK_ERROR();
+        if(!linked()) {
             GLint length;
             glGetProgramiv(_program, GL_INFO_LOG_LENGTH, &length);
-            check_error();
+            GL_CHECK_ERROR();
             std::vector<GLchar> log(length);
             glGetProgramInfoLog(_program, length, nullptr, log.data());
-            check_error();
+            GL_CHECK_ERROR();
             throw compilation_error(std::string(begin(log), end(log)));
         }
     }
 
+    bool linked() const
+    {
+        GLint linked;
+        glGetProgramiv(_program, GL_LINK_STATUS, &linked);
+        GL_CHECK_ERROR();
+        return linked != 0;
+    }
+
+    // Replaces the program with one saved by binary(). Returns false if the
+    // driver rejects it, e.g. after an update; the program must then be
+    // built from source.
+    bool load_binary(GLenum format, void const* data, GLsizei length)
+    {
+        glProgramBinary(_program, format, data, length);
+        // A rejected binary reports an error as well as a failed link;
+        // strict builds clear it so that the next check does not throw.
+        if(strict_errors)
+            glGetError();
+        return linked();
+    }
+
+    std::vector<char> binary(GLenum& format) const
+    {
+        GLint length = 0;
+        glGetProgramiv(_program, GL_PROGRAM_BINARY_LENGTH, &length);
+        GL_CHECK_ERROR();
+        std::vector<char> data(length);
+        if(length != 0)
+            glGetProgramBinary(_program, length, nullptr, &format, data.data());
+        GL_CHECK_ERROR();
+        return data;
+    }
+
     GLint uniform_location(GLchar const* name)
     {
         auto location = glGetUniformLocation(_program, name);
-        check_error();
+        GL_CHECK_ERROR();
         return location;
     }
 
     void use()
     {
-        glUseProgram(_program);
+        state().use_program(_program);
+    }
+
+    GLuint get() const
+    {
+        return _program;
     }
 
 private:
     GLuint _program;
 };
 
-shader load_shader(GLenum type, char const* path)
+class compute_program {
+public:
+    explicit compute_program(shader const& shader)
+    {
+        _program.attach(shader).link();
+        _program.use();
+        glGetProgramiv(_program.get(), GL_COMPUTE_WORK_GROUP_SIZE, _local_size);
+        GL_CHECK_ERROR();
+    }
+
+    GLint uniform_location(GLchar const* name)
+    {
+        return _program.uniform_location(name);
+    }
+
+    void use()
+    {
+        _program.use();
+    }
+
+    // Dispatches enough work groups to cover items invocations along x.
+    void dispatch(GLuint items)
+    {
+        GLuint local_size = static_cast<GLuint>(_local_size[0]);
+        glDispatchCompute((items + local_size - 1)/local_size, 1, 1);
+        GL_CHECK_ERROR();
+    }
+
+private:
+    program _program;
+    GLint _local_size[3];
+};
+
+std::string read_file(char const* path)
 {
-    std::ifstream ifs(path);
+    std::ifstream ifs(path, std::ios_base::binary);
+    if(!ifs)
+        throw std::runtime_error(std::string("cannot open ") + path);
     ifs.seekg(0, std::ios_base::end);
     std::size_t size = static_cast<std::size_t>(ifs.tellg());
     ifs.seekg(0, std::ios_base::beg);
-    std::vector<char> v(size);
-    ifs.read(v.data(), size);
-    shader shader(type, v.data(), size);
-    return shader;
+    std::string v(size, '\0');
+    ifs.read(&v[0], size);
+    return v;
 }
 
 }   // namespace gl
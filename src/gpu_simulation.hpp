@@ -0,0 +1,182 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "particles.hpp"
+#include "gl.hpp"
+#include "shader_sources.hpp"
+
+#include <algorithm>    // swap
+#include <cstddef>      // offsetof
+#include <vector>
+
+// Layout of a particle in GPU memory.
+struct gpu_particle
+{
+    vec2 position;
+    vec2 velocity;
+};
+
+// Simulation backend whose particle state lives in GPU memory.
+class gpu_simulation
+{
+public:
+    virtual ~gpu_simulation()
+    {
+    }
+
+    virtual void simulate(float dt) = 0;
+
+    // Binds the current positions as vertex attribute 0 for drawing.
+    virtual void bind_positions() = 0;
+
+    // Reads the current state back; only meant for validation.
+    virtual void download(vec2* positions, vec2* velocities) = 0;
+};
+
+// Runs the ballistic integration in a vertex shader and captures the result
+// with transform feedback. Particles ping-pong between two buffers and never
+// leave GPU memory; the current buffer can be drawn directly.
+class transform_feedback_simulation : public gpu_simulation
+{
+public:
+    template <class Store>
+    explicit transform_feedback_simulation(Store const& store) :
+        _size(static_cast<GLsizei>(store.size())),
+        _current(GL_ARRAY_BUFFER, static_cast<GLsizei>(_size*sizeof(gpu_particle)), GL_DYNAMIC_COPY),
+        _next(GL_ARRAY_BUFFER, static_cast<GLsizei>(_size*sizeof(gpu_particle)), GL_DYNAMIC_COPY)
+    {
+        _program
+            .attach(gl::load_shader(GL_VERTEX_SHADER, "particle_simulate.vert"))
+            .transform_feedback_varyings({"g_next_position", "g_next_velocity"}, GL_INTERLEAVED_ATTRIBS)
+            .link();
+        _dt_location = _program.uniform_location("g_dt");
+        upload(store);
+    }
+
+    GLsizei size() const
+    {
+        return _size;
+    }
+
+    template <class Store>
+    void upload(Store const& store)
+    {
+        std::vector<gpu_particle> staging(_size);
+        auto positions = store.template data<particles::position>();
+        auto velocities = store.template data<particles::velocity>();
+        for(GLsizei i = 0; i != _size; ++i) {
+            staging[i].position = positions[i];
+            staging[i].velocity = velocities[i];
+        }
+        _current.sub_data(GL_ARRAY_BUFFER, 0, _size*sizeof(gpu_particle), staging.data());
+    }
+
+    void download(vec2* positions, vec2* velocities) override
+    {
+        std::vector<gpu_particle> staging(_size);
+        _current.get_sub_data(GL_ARRAY_BUFFER, 0, _size*sizeof(gpu_particle), staging.data());
+        for(GLsizei i = 0; i != _size; ++i) {
+            positions[i] = staging[i].position;
+            velocities[i] = staging[i].velocity;
+        }
+    }
+
+    void simulate(float dt) override
+    {
+        _program.use();
+        glUniform1f(_dt_location, dt);
+        GL_CHECK_ERROR();
+
+        _current.bind(GL_ARRAY_BUFFER);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(gpu_particle),
+            reinterpret_cast<void const*>(offsetof(gpu_particle, position)));
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(gpu_particle),
+            reinterpret_cast<void const*>(offsetof(gpu_particle, velocity)));
+        GL_CHECK_ERROR();
+        _next.bind_base(GL_TRANSFORM_FEEDBACK_BUFFER, 0);
+
+        glEnable(GL_RASTERIZER_DISCARD);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, _size);
+        glEndTransformFeedback();
+        glDisable(GL_RASTERIZER_DISCARD);
+        GL_CHECK_ERROR();
+
+        glDisableVertexAttribArray(1);
+        gl::state().bind_buffer_base(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+        GL_CHECK_ERROR();
+        std::swap(_current, _next);
+    }
+
+    void bind_positions() override
+    {
+        _current.bind(GL_ARRAY_BUFFER);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(gpu_particle),
+            reinterpret_cast<void const*>(offsetof(gpu_particle, position)));
+        GL_CHECK_ERROR();
+    }
+
+private:
+    GLsizei _size;
+    gl::buffer _current;
+    gl::buffer _next;
+    gl::program _program;
+    GLint _dt_location;
+};
+
+// Runs the ballistic integration in a GL 4.3 compute shader. Positions and
+// velocities are separate shader storage buffers, mirroring the CPU channels,
+// and the render pass reads the position buffer as vertex input in place.
+class compute_simulation : public gpu_simulation
+{
+public:
+    template <class Store>
+    explicit compute_simulation(Store const& store) :
+        _size(static_cast<GLsizei>(store.size())),
+        _positions(_size),
+        _velocities(_size),
+        _program(gl::load_shader(GL_COMPUTE_SHADER, "particle_simulate.comp"))
+    {
+        _dt_location = _program.uniform_location("g_dt");
+        _count_location = _program.uniform_location("g_count");
+        _positions.upload(store.template data<particles::position>(), _size);
+        _velocities.upload(store.template data<particles::velocity>(), _size);
+    }
+
+    void simulate(float dt) override
+    {
+        _program.use();
+        glUniform1f(_dt_location, dt);
+        glUniform1ui(_count_location, static_cast<GLuint>(_size));
+        GL_CHECK_ERROR();
+        _positions.bind_base(0);
+        _velocities.bind_base(1);
+        _program.dispatch(static_cast<GLuint>(_size));
+        glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+        GL_CHECK_ERROR();
+    }
+
+    void bind_positions() override
+    {
+        _positions.bind(GL_ARRAY_BUFFER);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(vec2), nullptr);
+        GL_CHECK_ERROR();
+    }
+
+    void download(vec2* positions, vec2* velocities) override
+    {
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        _positions.download(positions, _size);
+        _velocities.download(velocities, _size);
+    }
+
+private:
+    GLsizei _size;
+    gl::shader_storage_buffer<vec2> _positions;
+    gl::shader_storage_buffer<vec2> _velocities;
+    gl::compute_program _program;
+    GLint _dt_location;
+    GLint _count_location;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "gl.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace gl
+{
+
+// Measures how long the GPU spends on each pass of a frame. Every pass
+// boundary writes a GL_TIMESTAMP query, so passes cost one query each and
+// need not nest like GL_TIME_ELAPSED queries would. Frames rotate through a
+// ring of FRAMES query sets; a set is read back FRAMES frames after it was
+// issued, when the GPU has long finished it, so reading never stalls. A
+// set that is still not ready is dropped rather than waited for.
+// Without GL 3.3 or ARB_timer_query the timer records nothing.
+class gpu_timer {
+public:
+    static unsigned const FRAMES = 4;
+
+    explicit gpu_timer(unsigned passes) :
+        _passes(passes),
+        _supported(GLEW_VERSION_3_3 || GLEW_ARB_timer_query),
+        _frame(0),
+        _pass(0),
+        _issued(FRAMES, false),
+        _totals(passes, 0.0),
+        _frames(0)
+    {
+        if(!_supported)
+            return;
+        _queries.resize(FRAMES*(passes + 1));
+        glGenQueries(static_cast<GLsizei>(_queries.size()), _queries.data());
+        GL_CHECK_ERROR();
+    }
+
+    ~gpu_timer()
+    {
+        if(!_queries.empty())
+            glDeleteQueries(static_cast<GLsizei>(_queries.size()), _queries.data());
+    }
+
+    gpu_timer(gpu_timer const&) = delete;
+    gpu_timer& operator=(gpu_timer const&) = delete;
+
+    bool supported() const
+    {
+        return _supported;
+    }
+
+    // Collects the oldest frame in the ring if it is ready, then marks the
+    // start of the first pass.
+    void begin_frame()
+    {
+        if(!_supported)
+            return;
+        _frame = (_frame + 1) % FRAMES;
+        if(_issued[_frame])
+            collect(_frame);
+        _issued[_frame] = false;
+        _pass = 0;
+        glQueryCounter(query(_frame, 0), GL_TIMESTAMP);
+        GL_CHECK_ERROR();
+    }
+
+    // Marks the end of the current pass and the start of the next.
+    void end_pass()
+    {
+        if(!_supported || _pass == _passes)
+            return;
+        ++_pass;
+        glQueryCounter(query(_frame, _pass), GL_TIMESTAMP);
+        GL_CHECK_ERROR();
+        if(_pass == _passes)
+            _issued[_frame] = true;
+    }
+
+    // Frames collected since the last reset().
+    unsigned frames() const
+    {
+        return _frames;
+    }
+
+    // Average GPU time of pass over the collected frames.
+    double milliseconds(unsigned pass) const
+    {
+        return _frames ? _totals[pass]/_frames : 0.0;
+    }
+
+    void reset()
+    {
+        _totals.assign(_passes, 0.0);
+        _frames = 0;
+    }
+
+private:
+    GLuint query(unsigned frame, unsigned boundary) const
+    {
+        return _queries[frame*(_passes + 1) + boundary];
+    }
+
+    void collect(unsigned frame)
+    {
+        // Queries complete in order, so the last one being ready means
+        // they all are.
+        GLint available = 0;
+        glGetQueryObjectiv(query(frame, _passes), GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+            return;
+        GLuint64 previous = 0;
+        glGetQueryObjectui64v(query(frame, 0), GL_QUERY_RESULT, &previous);
+        for(unsigned pass = 0; pass != _passes; ++pass) {
+            GLuint64 time = 0;
+            glGetQueryObjectui64v(query(frame, pass + 1), GL_QUERY_RESULT, &time);
+            _totals[pass] += (time - previous)*1e-6;
+            previous = time;
+        }
+        GL_CHECK_ERROR();
+        ++_frames;
+    }
+
+    unsigned _passes;
+    bool _supported;
+    unsigned _frame;
+    unsigned _pass;
+    std::vector<GLuint> _queries;   // [frame][boundary]
+    std::vector<bool> _issued;      // per frame, all boundaries written
+    std::vector<double> _totals;    // per pass, milliseconds
+    unsigned _frames;
+};
+
+}   // namespace gl
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "gl.hpp"
+
+#include <stdexcept>
+
+#if defined(SMOKE_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+namespace gl
+{
+
+#if defined(SMOKE_EGL)
+
+// A GL context with no window and no display connection, for machines
+// without one such as CI boxes running Mesa's llvmpipe. Uses the surfaceless
+// platform when the EGL implementation offers it and the default display
+// otherwise. Rendering needs a framebuffer object, since there is no default
+// framebuffer. Build with SMOKE_EGL, link libEGL, and use a GLEW built with
+// GLEW_EGL so that glewInit() resolves functions through EGL.
+class headless_context {
+public:
+    explicit headless_context(bool debug) :
+        _display(EGL_NO_DISPLAY),
+        _context(EGL_NO_CONTEXT)
+    {
+        auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if(get_platform_display)
+            _display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if(_display == EGL_NO_DISPLAY)
+            _display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if(_display == EGL_NO_DISPLAY || !eglInitialize(_display, nullptr, nullptr))
+            throw std::runtime_error("cannot initialize EGL");
+        if(!eglBindAPI(EGL_OPENGL_API)) {
+            eglTerminate(_display);
+            throw std::runtime_error("EGL has no desktop OpenGL");
+        }
+
+        // Like the window, a compatibility context of the highest version
+        // available.
+        EGLint const attributes[] = {
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+            EGL_CONTEXT_OPENGL_DEBUG, debug ? EGL_TRUE : EGL_FALSE,
+            EGL_NONE
+        };
+        _context = eglCreateContext(_display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+        if(_context == EGL_NO_CONTEXT || !eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, _context)) {
+            if(_context != EGL_NO_CONTEXT)
+                eglDestroyContext(_display, _context);
+            eglTerminate(_display);
+            throw std::runtime_error("cannot create a surfaceless EGL context");
+        }
+    }
+
+    ~headless_context()
+    {
+        eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(_display, _context);
+        eglTerminate(_display);
+    }
+
+    headless_context(headless_context const&) = delete;
+    headless_context& operator=(headless_context const&) = delete;
+
+private:
+    EGLDisplay _display;
+    EGLContext _context;
+};
+
+#else
+
+// Without EGL the context comes from a window that is never shown. This
+// still needs a desktop session, which every Windows machine has.
+class headless_context {
+public:
+    explicit headless_context(bool debug) :
+        _window(nullptr)
+    {
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+        if(debug)
+            glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+        _window = glfwCreateWindow(1, 1, "", nullptr, nullptr);
+        if(!_window)
+            throw std::runtime_error("cannot create a hidden window");
+        glfwMakeContextCurrent(_window);
+    }
+
+    ~headless_context()
+    {
+        glfwDestroyWindow(_window);
+    }
+
+    headless_context(headless_context const&) = delete;
+    headless_context& operator=(headless_context const&) = delete;
+
+private:
+    glfw_context _glfw;
+    GLFWwindow* _window;
+};
+
+#endif
+
+}   // namespace gl
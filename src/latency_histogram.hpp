@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Counts durations in buckets whose width grows with the value, like an
+// HdrHistogram: below 2*SUB nanoseconds every value has its own bucket, and
+// each further power of two is split into SUB buckets, so any value is
+// known to within 1/SUB, about 3%, from nanoseconds up to 2^LIMIT_BITS.
+// Larger values land in the last bucket; the largest value is also kept
+// exactly.
+//
+// Recording is a relaxed atomic increment, so any thread may record and
+// read at once without locks. A percentile read during recording reflects
+// some of the concurrent records and not others. reset() is not atomic
+// with respect to record().
+class latency_histogram
+{
+public:
+    static unsigned const SUB_BITS = 5;
+    static unsigned const SUB = 1u << SUB_BITS;
+    static unsigned const LIMIT_BITS = 36;      // 2^36 ns is about 69 s
+    static unsigned const BUCKETS = (LIMIT_BITS - SUB_BITS + 1)*SUB;
+
+    latency_histogram()
+    {
+        reset();
+    }
+
+    latency_histogram(latency_histogram const&) = delete;
+    latency_histogram& operator=(latency_histogram const&) = delete;
+
+    // Records a duration in nanoseconds; negative ones count as zero.
+    void record(std::int64_t nanoseconds)
+    {
+        std::uint64_t const value = nanoseconds > 0 ? static_cast<std::uint64_t>(nanoseconds) : 0;
+        _counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        std::int64_t max = _max.load(std::memory_order_relaxed);
+        while(nanoseconds > max && !_max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+        }
+    }
+
+    unsigned count() const
+    {
+        unsigned total = 0;
+        for(unsigned i = 0; i != BUCKETS; ++i)
+            total += _counts[i].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // The smallest recorded value that at least fraction of the records do
+    // not exceed, rounded up to its bucket's upper end, in nanoseconds. 0
+    // when nothing is recorded.
+    std::int64_t percentile(double fraction) const
+    {
+        unsigned counts[BUCKETS];
+        unsigned total = 0;
+        for(unsigned i = 0; i != BUCKETS; ++i) {
+            counts[i] = _counts[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        if(total == 0)
+            return 0;
+        // The rank of the record wanted, from 1.
+        double const wanted = fraction*total;
+        unsigned rank = static_cast<unsigned>(wanted);
+        if(rank < wanted || rank == 0)
+            ++rank;
+        if(rank > total)
+            rank = total;
+
+        std::int64_t const max = _max.load(std::memory_order_relaxed);
+        unsigned seen = 0;
+        for(unsigned i = 0; i != BUCKETS; ++i) {
+            seen += counts[i];
+            if(seen >= rank) {
+                std::int64_t const upper = static_cast<std::int64_t>(bucket_end(i)) - 1;
+                return upper < max ? upper : max;
+            }
+        }
+        return max;
+    }
+
+    // The largest value recorded, in nanoseconds.
+    std::int64_t max() const
+    {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        for(unsigned i = 0; i != BUCKETS; ++i)
+            _counts[i].store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static unsigned top_bit(std::uint64_t value)
+    {
+        unsigned bit = 0;
+        for(unsigned step = 32; step != 0; step /= 2) {
+            if(value >> step) {
+                value >>= step;
+                bit += step;
+            }
+        }
+        return bit;
+    }
+
+    // Values below 2*SUB index directly; above, the bucket is the top
+    // SUB_BITS + 1 bits of the value after the shift that leaves that many.
+    static unsigned bucket(std::uint64_t value)
+    {
+        std::uint64_t const limit = std::uint64_t(1) << LIMIT_BITS;
+        if(value >= limit)
+            value = limit - 1;
+        unsigned const top = top_bit(value);
+        unsigned const shift = top > SUB_BITS ? top - SUB_BITS : 0;
+        return shift*SUB + static_cast<unsigned>(value >> shift);
+    }
+
+    // One past the largest value in bucket i.
+    static std::uint64_t bucket_end(unsigned i)
+    {
+        if(i < 2*SUB)
+            return i + 1;
+        unsigned const shift = i/SUB - 1;
+        return static_cast<std::uint64_t>(i - shift*SUB + 1) << shift;
+    }
+
+    std::atomic<unsigned> _counts[BUCKETS];
+    std::atomic<std::int64_t> _max;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "gl.hpp"
+#include "particle_renderer.hpp"
+#include "particle_variant.hpp"
+
+#include <memory>       // unique_ptr
+
+// Draws the particles the cheapest way their on-screen size allows: point
+// sprites while they are small and instanced quads beyond. Geometry shader
+// fans save the quads' discarded corners but measure slower at every size,
+// so they are never picked. All particles share one radius, so the level is
+// chosen per draw from the current viewport; it follows the window size and
+// the density buffer's scale.
+class lod_renderer
+{
+public:
+    static float const SPRITE_MAX_RADIUS;   // pixels
+
+    explicit lod_renderer(particle_variant const& variant) :
+        _variant(variant),
+        _mode(render_mode::sprite)
+    {
+        GLfloat range[2];
+        glGetFloatv(GL_POINT_SIZE_RANGE, range);
+        GL_CHECK_ERROR();
+        _max_point_size = range[1];
+    }
+
+    // The mode of the last draw.
+    render_mode mode() const
+    {
+        return _mode;
+    }
+
+    void draw(GLsizei count, float aspect)
+    {
+        // Pixels are square, so the radius is the same along both axes.
+        float const radius = _variant.radius*0.5f*gl::state().viewport_width();
+        if(radius <= SPRITE_MAX_RADIUS && 2.0f*radius <= _max_point_size)
+            _mode = render_mode::sprite;
+        else
+            _mode = render_mode::instanced;
+
+        std::unique_ptr<particle_renderer>& renderer = _renderers[static_cast<int>(_mode)];
+        if(!renderer)
+            renderer.reset(new particle_renderer(_mode, _variant));
+        renderer->draw(count, aspect);
+    }
+
+private:
+    particle_variant _variant;
+    render_mode _mode;
+    float _max_point_size;
+    std::unique_ptr<particle_renderer> _renderers[3];   // by render_mode
+};
+
+float const lod_renderer::SPRITE_MAX_RADIUS = 4.0f;
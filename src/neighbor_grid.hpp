@@ -0,0 +1,231 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "particles.hpp"
+
+#include <algorithm>    // min, max
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over the particle bounds. build() counting-sorts the store by
+// cell (row-major), so the particles of a cell -- and of a horizontal run of
+// cells -- are contiguous in every channel.
+//
+// Every step of the sort runs on the pool. The particles are split into
+// blocks, each counted into its own histogram and later scattered by one
+// task in order, so the sort is stable and matches a serial one. A prefix
+// sum over the histograms, cell-major, gives every block its offset in each
+// cell. There are no more blocks than threads, nor than it takes for the
+// histograms together to stay about as small as the particles.
+class neighbor_grid
+{
+public:
+    static std::size_t const GRAIN = 16384;     // particles or cells per task
+    neighbor_grid() :
+        _origin(0.0f),
+        _cell_size(1.0f),
+        _width(0),
+        _height(0),
+        _high(0.0f)
+    {
+    }
+
+    template <class Store, class Pool>
+    void build(Store& store, float cell_size, Pool& pool)
+    {
+        std::size_t const count = store.size();
+        Store const& source = store;
+        vec2 const* positions = source.template data<particles::position>();
+
+        find_bounds(positions, count, pool);
+        _cell_size = cell_size;
+        _width = cell_count(_high.x - _origin.x, cell_size);
+        _height = cell_count(_high.y - _origin.y, cell_size);
+        std::size_t const cells = static_cast<std::size_t>(_width)*_height;
+
+        std::size_t const blocks = std::max<std::size_t>(1, std::min<std::size_t>(pool.size(), count/cells));
+        std::size_t const block_size = (count + blocks - 1)/blocks;
+        _cells.resize(count);
+        _counts.assign(blocks*cells, 0);
+        pool.parallel_for(blocks, 1, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t block = begin; block != end; ++block) {
+                std::uint32_t* counts = &_counts[block*cells];
+                for(std::size_t i = block*block_size; i < std::min(count, (block + 1)*block_size); ++i) {
+                    std::uint32_t const cell = cell_index(positions[i]);
+                    _cells[i] = cell;
+                    ++counts[cell];
+                }
+            }
+        });
+
+        // Chunks of cells sum their counts, the chunk sums are scanned, and
+        // then each chunk turns its counts into offsets from its start.
+        std::size_t const chunks = (cells + GRAIN - 1)/GRAIN;
+        _chunk_start.resize(chunks + 1);
+        _cell_start.resize(cells + 1);
+        pool.parallel_for(cells, GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t chunk = begin/GRAIN; chunk*GRAIN < end; ++chunk) {
+                std::uint32_t sum = 0;
+                for(std::size_t c = chunk*GRAIN; c != std::min(cells, (chunk + 1)*GRAIN); ++c)
+                    for(std::size_t block = 0; block != blocks; ++block)
+                        sum += _counts[block*cells + c];
+                _chunk_start[chunk + 1] = sum;
+            }
+        });
+        _chunk_start[0] = 0;
+        for(std::size_t chunk = 0; chunk != chunks; ++chunk)
+            _chunk_start[chunk + 1] += _chunk_start[chunk];
+        pool.parallel_for(cells, GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t chunk = begin/GRAIN; chunk*GRAIN < end; ++chunk) {
+                std::uint32_t offset = _chunk_start[chunk];
+                for(std::size_t c = chunk*GRAIN; c != std::min(cells, (chunk + 1)*GRAIN); ++c) {
+                    _cell_start[c] = offset;
+                    for(std::size_t block = 0; block != blocks; ++block) {
+                        std::uint32_t const n = _counts[block*cells + c];
+                        _counts[block*cells + c] = offset;
+                        offset += n;
+                    }
+                }
+            }
+        });
+        _cell_start[cells] = static_cast<std::uint32_t>(count);
+
+        _order.resize(count);
+        pool.parallel_for(blocks, 1, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t block = begin; block != end; ++block) {
+                std::uint32_t* next = &_counts[block*cells];
+                for(std::size_t i = block*block_size; i < std::min(count, (block + 1)*block_size); ++i)
+                    _order[next[_cells[i]]++] = static_cast<std::uint32_t>(i);
+            }
+        });
+        store.permute(_order, pool);
+    }
+
+    unsigned width() const
+    {
+        return _width;
+    }
+
+    unsigned height() const
+    {
+        return _height;
+    }
+
+    unsigned cell_x(vec2 const& p) const
+    {
+        return clamp_cell((p.x - _origin.x)/_cell_size, _width);
+    }
+
+    unsigned cell_y(vec2 const& p) const
+    {
+        return clamp_cell((p.y - _origin.y)/_cell_size, _height);
+    }
+
+    std::uint32_t cell_index(vec2 const& p) const
+    {
+        return cell_y(p)*_width + cell_x(p);
+    }
+
+    // Particle range of the cells x0..x1 (inclusive) in row y. Returned
+    // indices refer to the store as sorted by the last build().
+    void row_range(unsigned y, unsigned x0, unsigned x1, std::uint32_t& begin, std::uint32_t& end) const
+    {
+        begin = _cell_start[y*_width + x0];
+        end = _cell_start[y*_width + x1 + 1];
+    }
+
+    // Calls fn(begin, end) for the rows of the 3x3 block of cells around p.
+    template <class Fn>
+    void for_each_neighbor_range(vec2 const& p, Fn fn) const
+    {
+        unsigned cx = cell_x(p);
+        unsigned cy = cell_y(p);
+        unsigned x0 = cx == 0 ? 0 : cx - 1;
+        unsigned x1 = std::min(cx + 1, _width - 1);
+        unsigned y0 = cy == 0 ? 0 : cy - 1;
+        unsigned y1 = std::min(cy + 1, _height - 1);
+        for(unsigned y = y0; y <= y1; ++y) {
+            std::uint32_t begin, end;
+            row_range(y, x0, x1, begin, end);
+            if(begin != end)
+                fn(begin, end);
+        }
+    }
+
+private:
+    static unsigned const MAX_CELLS = 4096;
+
+    // Converting a NaN or out-of-range float to an integer is undefined, so
+    // cell coordinates are clamped while still floats. NaN lands in cell 0.
+    static unsigned clamp_cell(float offset, unsigned cells)
+    {
+        if(!(offset > 0.0f))
+            return 0;
+        if(offset >= static_cast<float>(cells - 1))
+            return cells - 1;
+        return static_cast<unsigned>(offset);
+    }
+
+    // Cells along an axis of the given extent: at least one, at most
+    // MAX_CELLS, and one for NaN bounds.
+    static unsigned cell_count(float extent, float cell_size)
+    {
+        float const cells = extent/cell_size;
+        if(!(cells >= 0.0f))
+            return 1;
+        if(cells >= static_cast<float>(MAX_CELLS - 1))
+            return MAX_CELLS;
+        return static_cast<unsigned>(cells) + 1;
+    }
+
+    // Sets _origin and _high to the bounds of the positions, which the
+    // threads reduce a block each. NaN coordinates are skipped unless they
+    // come first in a block.
+    template <class Pool>
+    void find_bounds(vec2 const* positions, std::size_t count, Pool& pool)
+    {
+        std::size_t const blocks = std::max<std::size_t>(1, std::min<std::size_t>(pool.size(), count/GRAIN));
+        std::size_t const block_size = (count + blocks - 1)/blocks;
+        _block_low.assign(blocks, vec2(0.0f));
+        _block_high.assign(blocks, vec2(0.0f));
+        pool.parallel_for(blocks, 1, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t block = begin; block != end; ++block) {
+                std::size_t const first = block*block_size;
+                std::size_t const last = std::min(count, first + block_size);
+                if(first >= last)
+                    continue;
+                vec2 lo = positions[first], hi = positions[first];
+                for(std::size_t i = first + 1; i < last; ++i) {
+                    lo.x = std::min(lo.x, positions[i].x);
+                    lo.y = std::min(lo.y, positions[i].y);
+                    hi.x = std::max(hi.x, positions[i].x);
+                    hi.y = std::max(hi.y, positions[i].y);
+                }
+                _block_low[block] = lo;
+                _block_high[block] = hi;
+            }
+        });
+        _origin = _block_low[0];
+        _high = _block_high[0];
+        for(std::size_t block = 1; block < blocks && block*block_size < count; ++block) {
+            _origin.x = std::min(_origin.x, _block_low[block].x);
+            _origin.y = std::min(_origin.y, _block_low[block].y);
+            _high.x = std::max(_high.x, _block_high[block].x);
+            _high.y = std::max(_high.y, _block_high[block].y);
+        }
+    }
+
+    vec2 _origin;
+    float _cell_size;
+    unsigned _width;
+    unsigned _height;
+    vec2 _high;
+    std::vector<vec2> _block_low;
+    std::vector<vec2> _block_high;
+    std::vector<std::uint32_t> _cells;
+    std::vector<std::uint32_t> _counts;         // [block][cell], then offsets
+    std::vector<std::uint32_t> _chunk_start;    // per chunk of cells, then the total
+    std::vector<std::uint32_t> _cell_start;
+    std::vector<std::uint32_t> _order;
+};
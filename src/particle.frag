@@ -1,8 +1,10 @@
 #version 130
 
+#include "particle_common.glsl"
+
 in float g_Distance;
 
 void main()
 {
-    gl_FragColor = vec4(g_Distance, g_Distance, g_Distance, 1.0);
+    gl_FragColor = vec4(vec3(falloff(g_Distance)), 1.0);
 }
@@ -0,0 +1,20 @@
+// Shared by the particle programs. The renderer defines PARTICLE_RADIUS,
+// PARTICLE_SEGMENTS, PARTICLE_MAX_VERTICES and PARTICLE_FALLOFF for each
+// variant; see particle_variant.hpp.
+
+#define FALLOFF_LINEAR 0
+#define FALLOFF_QUADRATIC 1
+#define FALLOFF_SMOOTH 2
+
+// Brightness at distance = 1 - r/PARTICLE_RADIUS, which is 1 at the centre
+// and 0 at the rim.
+float falloff(float distance)
+{
+#if PARTICLE_FALLOFF == FALLOFF_QUADRATIC
+    return distance*distance;
+#elif PARTICLE_FALLOFF == FALLOFF_SMOOTH
+    return distance*distance*(3.0 - 2.0*distance);
+#else
+    return distance;
+#endif
+}
@@ -0,0 +1,13 @@
+#version 130
+
+#include "particle_common.glsl"
+
+in vec2 g_Offset;
+
+void main()
+{
+    float distance = 1.0 - length(g_Offset);
+    if(distance <= 0.0)
+        discard;
+    gl_FragColor = vec4(vec3(falloff(distance)), 1.0);
+}
@@ -0,0 +1,18 @@
+#version 330
+
+layout(location=0) in vec2 g_position;
+uniform float g_aspect;
+out vec2 g_Offset;
+
+#include "particle_common.glsl"
+
+// Drawn instanced as a 4-vertex triangle strip; g_position advances per
+// instance and gl_VertexID picks the corner.
+void main()
+{
+    vec2 corner = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0,
+        (gl_VertexID & 2) == 0 ? -1.0 : 1.0);
+    g_Offset = corner;
+    gl_Position = vec4(g_position +
+        vec2(PARTICLE_RADIUS, PARTICLE_RADIUS*g_aspect)*corner, 0.0, 1.0);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "gl.hpp"
+#include "program_cache.hpp"
+#include "particle_variant.hpp"
+
+#include <iomanip>      // setprecision
+#include <limits>
+#include <map>
+#include <memory>       // unique_ptr
+#include <sstream>      // ostringstream
+#include <string>       // to_string
+
+enum class render_mode
+{
+    geometry,   // geometry shader expands each point into a triangle fan
+    instanced,  // one instanced quad per particle, analytic falloff
+    sprite      // one point sprite per particle, cheapest for large counts
+};
+
+// Draws the particles whose positions are bound as vertex attribute 0, with
+// the programs specialized for the selected particle_variant. Programs are
+// built on first use and kept, so switching between variants is cheap.
+class particle_renderer
+{
+public:
+    explicit particle_renderer(render_mode mode, particle_variant const& variant = particle_variant()) :
+        _mode(mode),
+        _current(nullptr)
+    {
+        if(mode == render_mode::sprite) {
+            // The window has a compatibility context, where gl_PointCoord
+            // is only defined with GL_POINT_SPRITE enabled.
+            glEnable(GL_PROGRAM_POINT_SIZE);
+            glEnable(GL_POINT_SPRITE);
+            GL_CHECK_ERROR();
+        }
+        select(variant);
+    }
+
+    render_mode mode() const
+    {
+        return _mode;
+    }
+
+    particle_variant const& variant() const
+    {
+        return _variant;
+    }
+
+    // Switches to the programs for variant, building them the first time.
+    void select(particle_variant const& variant)
+    {
+        // Only the geometry shader tessellates.
+        particle_variant key = variant;
+        if(_mode != render_mode::geometry)
+            key.segments = particle_variant().segments;
+        auto it = _programs.find(key);
+        if(it == _programs.end())
+            it = _programs.insert(std::make_pair(key, build(key))).first;
+        _current = it->second.get();
+        _variant = variant;
+    }
+
+    void draw(GLsizei count, float aspect)
+    {
+        variant_program& current = *_current;
+        current.program.use();
+        // The programs are private to this renderer, so the last values set
+        // are still current.
+        if(aspect != current.aspect) {
+            glUniform1f(current.aspect_location, aspect);
+            GL_CHECK_ERROR();
+            current.aspect = aspect;
+        }
+        switch(_mode)
+        {
+        case render_mode::geometry:
+            glDrawArrays(GL_POINTS, 0, count);
+            break;
+        case render_mode::instanced:
+            // The divisor is per attribute index, and the GPU backends feed
+            // attribute 0 per vertex, so only keep it set for this draw.
+            glVertexAttribDivisor(0, 1);
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+            glVertexAttribDivisor(0, 0);
+            break;
+        case render_mode::sprite:
+            if(gl::state().viewport_height() != current.viewport_height) {
+                current.viewport_height = gl::state().viewport_height();
+                glUniform1f(current.viewport_height_location, static_cast<float>(current.viewport_height));
+            }
+            glDrawArrays(GL_POINTS, 0, count);
+            break;
+        }
+        GL_CHECK_ERROR();
+    }
+
+private:
+    struct variant_program
+    {
+        variant_program() :
+            viewport_height_location(-1),
+            aspect(std::numeric_limits<float>::quiet_NaN()),
+            viewport_height(-1)
+        {
+        }
+
+        gl::program program;
+        GLint aspect_location;
+        GLint viewport_height_location;
+        float aspect;
+        GLint viewport_height;
+    };
+
+    std::unique_ptr<variant_program> build(particle_variant const& variant) const
+    {
+        std::unique_ptr<variant_program> result(new variant_program);
+        gl::shader_defines const defines = make_defines(variant);
+        switch(_mode)
+        {
+        case render_mode::geometry:
+            gl::programs().build(result->program, {
+                {GL_VERTEX_SHADER, "particle.vert"},
+                {GL_GEOMETRY_SHADER, "particle.geom"},
+                {GL_FRAGMENT_SHADER, "particle.frag"}}, defines);
+            break;
+        case render_mode::instanced:
+            gl::programs().build(result->program, {
+                {GL_VERTEX_SHADER, "particle_quad.vert"},
+                {GL_FRAGMENT_SHADER, "particle_quad.frag"}}, defines);
+            break;
+        case render_mode::sprite:
+            gl::programs().build(result->program, {
+                {GL_VERTEX_SHADER, "particle_sprite.vert"},
+                {GL_FRAGMENT_SHADER, "particle_sprite.frag"}}, defines);
+            result->viewport_height_location = result->program.uniform_location("g_viewport_height");
+            break;
+        }
+        result->aspect_location = result->program.uniform_location("g_aspect");
+        return result;
+    }
+
+    // See particle_common.glsl.
+    static gl::shader_defines make_defines(particle_variant const& variant)
+    {
+        static char const* const falloffs[] = {"FALLOFF_LINEAR", "FALLOFF_QUADRATIC", "FALLOFF_SMOOTH"};
+        std::ostringstream radius;
+        radius << std::showpoint << std::setprecision(9) << variant.radius;
+        gl::shader_defines defines;
+        defines.push_back(gl::shader_define{"PARTICLE_RADIUS", radius.str()});
+        defines.push_back(gl::shader_define{"PARTICLE_SEGMENTS", std::to_string(variant.segments)});
+        defines.push_back(gl::shader_define{"PARTICLE_MAX_VERTICES", std::to_string(2*variant.segments + 2)});
+        defines.push_back(gl::shader_define{"PARTICLE_FALLOFF", falloffs[static_cast<int>(variant.falloff)]});
+        return defines;
+    }
+
+    render_mode _mode;
+    particle_variant _variant;
+    std::map<particle_variant, std::unique_ptr<variant_program>> _programs;
+    variant_program* _current;
+};
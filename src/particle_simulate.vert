@@ -0,0 +1,17 @@
+#version 330
+
+layout(location=0) in vec2 g_position;
+layout(location=1) in vec2 g_velocity;
+uniform float g_dt;
+out vec2 g_next_position;
+out vec2 g_next_velocity;
+
+const float GRAVITY = 0.05;
+
+void main()
+{
+    vec2 acceleration = -g_position*GRAVITY;
+    vec2 velocity = g_velocity + g_dt*acceleration;
+    g_next_position = g_position + g_dt*velocity;
+    g_next_velocity = velocity;
+}
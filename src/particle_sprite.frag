@@ -0,0 +1,11 @@
+#version 130
+
+#include "particle_common.glsl"
+
+void main()
+{
+    float distance = 1.0 - length(2.0*gl_PointCoord - 1.0);
+    if(distance <= 0.0)
+        discard;
+    gl_FragColor = vec4(vec3(falloff(distance)), 1.0);
+}
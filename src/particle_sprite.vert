@@ -0,0 +1,14 @@
+#version 330
+
+layout(location=0) in vec2 g_position;
+uniform float g_aspect;
+uniform float g_viewport_height;
+
+#include "particle_common.glsl"
+
+void main()
+{
+    gl_Position = vec4(g_position, 0.0, 1.0);
+    // The geometry shader's disc is PARTICLE_RADIUS*g_aspect tall in NDC.
+    gl_PointSize = PARTICLE_RADIUS*g_aspect*g_viewport_height;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <tuple>        // tie
+
+// Brightness across a particle, from its centre to its rim.
+enum class falloff_curve
+{
+    linear,     // 1 - r
+    quadratic,  // (1 - r)^2, a tighter core
+    smooth      // smoothstep of 1 - r, a flatter core
+};
+
+// The compile-time parameters of the particle shapes. Each distinct value
+// is specialized into its own programs, so the cheapest shape a scene
+// allows costs nothing for the ones it does not use.
+struct particle_variant
+{
+    static unsigned const MIN_SEGMENTS = 3;
+    // 2*segments + 2 vertices of five components must stay within the
+    // minimum GL_MAX_GEOMETRY_TOTAL_OUTPUT_COMPONENTS of 1024.
+    static unsigned const MAX_SEGMENTS = 64;
+
+    particle_variant() :
+        radius(0.01f),
+        segments(16),
+        falloff(falloff_curve::linear)
+    {
+    }
+
+    float radius;           // NDC, horizontally; scaled by the aspect ratio vertically
+    unsigned segments;      // of the geometry shader's triangle fan
+    falloff_curve falloff;
+};
+
+inline bool operator<(particle_variant const& a, particle_variant const& b)
+{
+    return std::tie(a.radius, a.segments, a.falloff) < std::tie(b.radius, b.segments, b.falloff);
+}
+
+inline bool operator==(particle_variant const& a, particle_variant const& b)
+{
+    return a.radius == b.radius && a.segments == b.segments && a.falloff == b.falloff;
+}
+
+inline bool operator!=(particle_variant const& a, particle_variant const& b)
+{
+    return !(a == b);
+}
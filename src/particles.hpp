@@ -0,0 +1,440 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "aligned_allocator.hpp"
+
+#include <algorithm>    // min, max
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>       // unique_ptr
+#include <tuple>
+#include <type_traits>  // conditional, integral_constant
+#include <utility>      // forward
+#include <vector>
+
+namespace particles
+{
+
+// Channels are declared once as tag types; the store keeps one aligned array
+// per channel.
+struct position    { typedef vec2 value_type; };
+struct velocity    { typedef vec2 value_type; };
+struct age         { typedef float value_type; };
+struct temperature { typedef float value_type; };
+struct density     { typedef float value_type; };
+struct color       { typedef std::uint32_t value_type; };   // RGBA8
+struct circulation { typedef float value_type; };
+
+std::size_t const alignment = 64;
+std::size_t const chunk_size = 1024;    // granularity of dirty tracking
+
+template <class Channel>
+using array = std::vector<typename Channel::value_type,
+    aligned_allocator<typename Channel::value_type, alignment>>;
+
+namespace detail
+{
+    template <class T, class... Ts>
+    struct index_of;
+
+    template <class T, class... Ts>
+    struct index_of<T, T, Ts...> : std::integral_constant<std::size_t, 0>
+    {
+    };
+
+    template <class T, class U, class... Ts>
+    struct index_of<T, U, Ts...> :
+        std::integral_constant<std::size_t, 1 + index_of<T, Ts...>::value>
+    {
+    };
+
+    template <class T, class... Ts>
+    struct contains;
+
+    template <class T>
+    struct contains<T> : std::false_type
+    {
+    };
+
+    template <class T, class U, class... Ts>
+    struct contains<T, U, Ts...> :
+        std::integral_constant<bool, std::is_same<T, U>::value || contains<T, Ts...>::value>
+    {
+    };
+
+    inline void expand(std::initializer_list<int>)
+    {
+    }
+
+    template <class T>
+    struct always_void
+    {
+        typedef void type;
+    };
+}
+
+// Kernels declare the channels they touch with these lists, e.g.
+//     typedef particles::reads<position> reads;
+//     typedef particles::writes<velocity> writes;
+template <class... Channels>
+struct reads
+{
+    template <class Channel>
+    struct has : detail::contains<Channel, Channels...>
+    {
+    };
+};
+
+template <class... Channels>
+struct writes
+{
+    template <class Channel>
+    struct has : detail::contains<Channel, Channels...>
+    {
+    };
+};
+
+// Written channels a kernel marks dirty itself through view::mark(), for
+// kernels that leave parts of their range untouched, e.g.
+//     typedef particles::marks<position> marks;
+template <class... Channels>
+struct marks
+{
+    template <class Channel>
+    struct has : detail::contains<Channel, Channels...>
+    {
+    };
+};
+
+namespace detail
+{
+    template <class Kernel, class = void>
+    struct marks_of
+    {
+        typedef particles::marks<> type;
+    };
+
+    template <class Kernel>
+    struct marks_of<Kernel, typename always_void<typename Kernel::marks>::type>
+    {
+        typedef typename Kernel::marks type;
+    };
+}
+
+// One dirty flag per chunk_size particles of a channel. mark() may be
+// called from several threads at once; consume() must not overlap it.
+class dirty_chunks
+{
+public:
+    dirty_chunks() :
+        _count(0),
+        _chunks(0)
+    {
+    }
+
+    dirty_chunks(dirty_chunks const&) = delete;
+    dirty_chunks& operator=(dirty_chunks const&) = delete;
+
+    // Resizing marks everything dirty.
+    void resize(std::size_t count)
+    {
+        std::size_t chunks = (count + chunk_size - 1)/chunk_size;
+        if(chunks != _chunks) {
+            _flags.reset(new std::atomic<unsigned char>[chunks]);
+            _chunks = chunks;
+        }
+        _count = count;
+        mark_all();
+    }
+
+    void mark(std::size_t begin, std::size_t end)
+    {
+        if(begin >= end)
+            return;
+        for(std::size_t c = begin/chunk_size, last = (end - 1)/chunk_size; c <= last; ++c)
+            _flags[c].store(1, std::memory_order_relaxed);
+    }
+
+    void mark_all()
+    {
+        mark(0, _count);
+    }
+
+    // Calls fn(begin, end) for each maximal run of dirty chunks, clipped to
+    // the size, and clears their flags.
+    template <class Fn>
+    void consume(Fn fn)
+    {
+        std::size_t c = 0;
+        while(c != _chunks) {
+            if(!_flags[c].load(std::memory_order_relaxed)) {
+                ++c;
+                continue;
+            }
+            std::size_t first = c;
+            for(; c != _chunks && _flags[c].load(std::memory_order_relaxed); ++c)
+                _flags[c].store(0, std::memory_order_relaxed);
+            fn(first*chunk_size, std::min(c*chunk_size, _count));
+        }
+    }
+
+private:
+    std::size_t _count;
+    std::size_t _chunks;
+    std::unique_ptr<std::atomic<unsigned char>[]> _flags;
+};
+
+template <class Store, class Reads, class Writes>
+class view;
+
+// Besides the channel arrays, the store tracks which chunks of each channel
+// were written: by kernels for their declared writes channels and range, or
+// where they say for channels in their marks list; by reordering wherever a
+// particle's index changed; and entirely by resizing or mutable data()
+// access.
+template <class... Channels>
+class store
+{
+public:
+    store() :
+        _size(0)
+    {
+    }
+
+    explicit store(std::size_t size) :
+        _size(0)
+    {
+        resize(size);
+    }
+
+    store(store const&) = delete;
+    store& operator=(store const&) = delete;
+
+    template <class Channel>
+    struct has : detail::contains<Channel, Channels...>
+    {
+    };
+
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+    void resize(std::size_t size)
+    {
+        detail::expand({(channel<Channels>().resize(size), 0)...});
+        for(auto& dirty : _dirty)
+            dirty.resize(size);
+        _size = size;
+    }
+
+    // The caller may write anywhere, so the whole channel becomes dirty.
+    template <class Channel>
+    typename Channel::value_type* data()
+    {
+        dirty<Channel>().mark_all();
+        return channel<Channel>().data();
+    }
+
+    template <class Channel>
+    typename Channel::value_type const* data() const
+    {
+        return channel<Channel>().data();
+    }
+
+    // Runs kernel(view, begin, end) where the view only exposes the channels
+    // named in Kernel::reads and Kernel::writes.
+    template <class Kernel>
+    void run(Kernel&& kernel, std::size_t begin, std::size_t end)
+    {
+        typedef typename std::decay<Kernel>::type kernel_type;
+        view<store, typename kernel_type::reads, typename kernel_type::writes> v(*this);
+        kernel(v, begin, end);
+        detail::expand({(mark_written<Channels, typename kernel_type::writes,
+            typename detail::marks_of<kernel_type>::type>(begin, end), 0)...});
+    }
+
+    template <class Kernel>
+    void run(Kernel&& kernel)
+    {
+        run(std::forward<Kernel>(kernel), 0, _size);
+    }
+
+    // Removes every particle i for which keep(i) is false, preserving the
+    // order of the remaining particles in all channels. Returns the new size.
+    template <class Keep>
+    std::size_t compact(Keep keep)
+    {
+        _order.clear();
+        for(std::size_t i = 0; i != _size; ++i) {
+            if(keep(i))
+                _order.push_back(static_cast<std::uint32_t>(i));
+        }
+        std::size_t n = _order.size();
+        detail::expand({(compact_channel<Channels>(), 0)...});
+        resize(n);
+        return n;
+    }
+
+    // Reorders all channels so that new particle i is old particle order[i].
+    void permute(std::vector<std::uint32_t> const& order)
+    {
+        detail::expand({(gather_channel<Channels>(order, 0, order.size()), 0)...});
+        detail::expand({(swap_scratch<Channels>(), 0)...});
+        mark_moved(order, 0, order.size());
+    }
+
+    // As above, with the gather split over pool.parallel_for.
+    template <class Pool>
+    void permute(std::vector<std::uint32_t> const& order, Pool& pool)
+    {
+        detail::expand({(resize_scratch<Channels>(), 0)...});
+        pool.parallel_for(order.size(), 16384, [&](unsigned, std::size_t begin, std::size_t end) {
+            detail::expand({(gather_channel<Channels>(order, begin, end), 0)...});
+            mark_moved(order, begin, end);
+        });
+        detail::expand({(swap_scratch<Channels>(), 0)...});
+    }
+
+    // Chunks of Channel written since the last consume().
+    template <class Channel>
+    dirty_chunks& dirty()
+    {
+        static_assert(has<Channel>::value, "channel is not declared in this store");
+        return _dirty[detail::index_of<Channel, Channels...>::value];
+    }
+
+private:
+    template <class Store, class Reads, class Writes>
+    friend class view;
+
+    template <class Channel, class Writes, class Marks>
+    void mark_written(std::size_t begin, std::size_t end)
+    {
+        if(Writes::template has<Channel>::value && !Marks::template has<Channel>::value)
+            dirty<Channel>().mark(begin, end);
+    }
+
+    // Marks, in every channel, the chunks of [begin, end) where order is not
+    // the identity. A stable sort of particles that stay put marks nothing.
+    void mark_moved(std::vector<std::uint32_t> const& order, std::size_t begin, std::size_t end)
+    {
+        for(std::size_t chunk = begin/chunk_size; chunk*chunk_size < end; ++chunk) {
+            std::size_t const first = std::max(begin, chunk*chunk_size);
+            std::size_t const last = std::min(end, (chunk + 1)*chunk_size);
+            for(std::size_t i = first; i != last; ++i) {
+                if(order[i] != i) {
+                    for(auto& dirty : _dirty)
+                        dirty.mark(first, last);
+                    break;
+                }
+            }
+        }
+    }
+
+    template <class Channel>
+    array<Channel>& channel()
+    {
+        static_assert(has<Channel>::value, "channel is not declared in this store");
+        return std::get<detail::index_of<Channel, Channels...>::value>(_channels);
+    }
+
+    template <class Channel>
+    array<Channel> const& channel() const
+    {
+        static_assert(has<Channel>::value, "channel is not declared in this store");
+        return std::get<detail::index_of<Channel, Channels...>::value>(_channels);
+    }
+
+    template <class Channel>
+    void compact_channel()
+    {
+        auto& values = channel<Channel>();
+        // _order is increasing, so moving forward in place is safe.
+        for(std::size_t i = 0; i != _order.size(); ++i)
+            values[i] = values[_order[i]];
+    }
+
+    template <class Channel>
+    array<Channel>& scratch()
+    {
+        return std::get<detail::index_of<Channel, Channels...>::value>(_scratch);
+    }
+
+    template <class Channel>
+    void resize_scratch()
+    {
+        scratch<Channel>().resize(_size);
+    }
+
+    template <class Channel>
+    void gather_channel(std::vector<std::uint32_t> const& order, std::size_t begin, std::size_t end)
+    {
+        auto const& values = channel<Channel>();
+        auto& target = scratch<Channel>();
+        if(target.size() != _size)
+            target.resize(_size);
+        for(std::size_t i = begin; i != end; ++i)
+            target[i] = values[order[i]];
+    }
+
+    template <class Channel>
+    void swap_scratch()
+    {
+        channel<Channel>().swap(scratch<Channel>());
+    }
+
+    std::tuple<array<Channels>...> _channels;
+    std::tuple<array<Channels>...> _scratch;
+    std::array<dirty_chunks, sizeof...(Channels)> _dirty;
+    std::vector<std::uint32_t> _order;
+    std::size_t _size;
+};
+
+template <class Store, class Reads, class Writes>
+class view
+{
+public:
+    explicit view(Store& store) :
+        _store(store)
+    {
+    }
+
+    template <class Channel>
+    struct accessor
+    {
+        static_assert(Reads::template has<Channel>::value || Writes::template has<Channel>::value,
+            "kernel does not declare this channel");
+        typedef typename std::conditional<Writes::template has<Channel>::value,
+            typename Channel::value_type*,
+            typename Channel::value_type const*>::type type;
+    };
+
+    // Writes are accounted for by store::run(), not here.
+    template <class Channel>
+    typename accessor<Channel>::type get() const
+    {
+        return _store.template channel<Channel>().data();
+    }
+
+    // Records a write to [begin, end) of a channel in the kernel's marks.
+    template <class Channel>
+    void mark(std::size_t begin, std::size_t end) const
+    {
+        static_assert(Writes::template has<Channel>::value, "kernel does not declare this channel");
+        _store.template dirty<Channel>().mark(begin, end);
+    }
+
+    std::size_t size() const
+    {
+        return _store.size();
+    }
+
+private:
+    Store& _store;
+};
+
+}   // namespace particles
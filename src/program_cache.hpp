@@ -0,0 +1,194 @@
+#pragma once
+
+#include "gl.hpp"
+#include "shader_sources.hpp"
+
+#include <cstdint>
+#include <cstring>      // strlen
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>      // setw, setfill
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace gl
+{
+
+struct shader_stage
+{
+    GLenum type;
+    char const* name;   // see shader_sources
+};
+
+// Keeps linked program binaries on disk, one file per program, named by a
+// hash of the stage sources and the driver's vendor, renderer and version
+// strings. A missing, stale or rejected binary falls back to compiling.
+// Disabled until a directory is set or if the driver has no binary formats.
+class program_cache {
+public:
+    program_cache() :
+        _hits(0),
+        _misses(0)
+    {
+    }
+
+    // The directory must exist; an empty one disables the cache.
+    void set_directory(std::string const& directory)
+    {
+        _directory = directory;
+    }
+
+    bool enabled() const
+    {
+        return !_directory.empty();
+    }
+
+    unsigned hits() const
+    {
+        return _hits;
+    }
+
+    unsigned misses() const
+    {
+        return _misses;
+    }
+
+    // Links program from the given stages, each preprocessed with defines.
+    // Every set of defines hashes to its own binary.
+    void build(program& program, std::initializer_list<shader_stage> stages,
+        shader_defines const& defines = shader_defines())
+    {
+        std::vector<std::string> sources;
+        for(auto const& stage : stages)
+            sources.push_back(shader_sources().preprocess(stage.name, defines));
+
+        if(!usable()) {
+            compile(program, stages, sources);
+            return;
+        }
+
+        std::string const path = file_name(stages, sources);
+        if(load(program, path)) {
+            ++_hits;
+            return;
+        }
+        ++_misses;
+        program.binary_retrievable();
+        compile(program, stages, sources);
+        save(program, path);
+    }
+
+private:
+    static std::uint32_t const MAGIC = 0x504b4d53;  // "SMKP"
+
+    bool usable() const
+    {
+        if(!enabled() || !(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+            return false;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
+    }
+
+    static void compile(program& program, std::initializer_list<shader_stage> stages,
+        std::vector<std::string> const& sources)
+    {
+        std::size_t i = 0;
+        for(auto const& stage : stages) {
+            shader shader(stage.type, sources[i].data(), static_cast<GLint>(sources[i].size()));
+            program.attach(shader);
+            ++i;
+        }
+        program.link();
+    }
+
+    // 64-bit FNV-1a.
+    static void hash(std::uint64_t& h, void const* data, std::size_t size)
+    {
+        auto bytes = static_cast<unsigned char const*>(data);
+        for(std::size_t i = 0; i != size; ++i) {
+            h ^= bytes[i];
+            h *= 0x100000001b3ull;
+        }
+    }
+
+    static void hash_string(std::uint64_t& h, GLenum name)
+    {
+        auto value = reinterpret_cast<char const*>(glGetString(name));
+        if(value)
+            hash(h, value, std::strlen(value) + 1);
+    }
+
+    std::string file_name(std::initializer_list<shader_stage> stages, std::vector<std::string> const& sources) const
+    {
+        std::uint64_t h = 0xcbf29ce484222325ull;
+        hash_string(h, GL_VENDOR);
+        hash_string(h, GL_RENDERER);
+        hash_string(h, GL_VERSION);
+        std::size_t i = 0;
+        for(auto const& stage : stages) {
+            hash(h, &stage.type, sizeof(stage.type));
+            hash(h, sources[i].data(), sources[i].size() + 1);
+            ++i;
+        }
+        std::ostringstream name;
+        name << _directory << "/" << std::hex << std::setw(16) << std::setfill('0') << h << ".bin";
+        return name.str();
+    }
+
+    static bool load(program& program, std::string const& path)
+    {
+        std::ifstream in(path.c_str(), std::ios_base::binary);
+        std::uint32_t magic = 0;
+        GLenum format = 0;
+        std::uint32_t length = 0;
+        in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        in.read(reinterpret_cast<char*>(&format), sizeof(format));
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if(!in || magic != MAGIC)
+            return false;
+        // save() writes exactly length bytes after the header; anything
+        // else is a damaged file, and its length is not to be allocated.
+        std::streamoff const header = in.tellg();
+        in.seekg(0, std::ios_base::end);
+        std::streamoff const remaining = in.tellg() - header;
+        in.seekg(header);
+        if(!in || length == 0 || remaining != static_cast<std::streamoff>(length))
+            return false;
+        std::vector<char> data(length);
+        in.read(data.data(), length);
+        if(!in)
+            return false;
+        return program.load_binary(format, data.data(), static_cast<GLsizei>(length));
+    }
+
+    // Failing to write only costs the next start a compile.
+    static void save(program const& program, std::string const& path)
+    {
+        GLenum format = 0;
+        std::vector<char> data = program.binary(format);
+        if(data.empty())
+            return;
+        std::ofstream out(path.c_str(), std::ios_base::binary);
+        std::uint32_t magic = MAGIC;
+        std::uint32_t length = static_cast<std::uint32_t>(data.size());
+        out.write(reinterpret_cast<char const*>(&magic), sizeof(magic));
+        out.write(reinterpret_cast<char const*>(&format), sizeof(format));
+        out.write(reinterpret_cast<char const*>(&length), sizeof(length));
+        out.write(data.data(), data.size());
+    }
+
+    std::string _directory;
+    unsigned _hits;
+    unsigned _misses;
+};
+
+// The cache shared by everything that builds programs.
+program_cache& programs()
+{
+    static program_cache cache;
+    return cache;
+}
+
+}   // namespace gl
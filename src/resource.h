@@ -0,0 +1,15 @@
+#pragma once
+
+// Shader sources embedded by shaders.rc, as RCDATA.
+#define IDR_PARTICLE_VERT           101
+#define IDR_PARTICLE_GEOM           102
+#define IDR_PARTICLE_FRAG           103
+#define IDR_PARTICLE_QUAD_VERT      104
+#define IDR_PARTICLE_QUAD_FRAG      105
+#define IDR_PARTICLE_SPRITE_VERT    106
+#define IDR_PARTICLE_SPRITE_FRAG    107
+#define IDR_PARTICLE_SIMULATE_VERT  108
+#define IDR_PARTICLE_SIMULATE_COMP  109
+#define IDR_DENSITY_COMPOSITE_VERT  110
+#define IDR_DENSITY_COMPOSITE_FRAG  111
+#define IDR_PARTICLE_COMMON_GLSL    112
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "gl.hpp"
+#include "resource.h"
+
+#include <algorithm>    // find, find_if
+#include <cstddef>
+#include <cstring>      // strcmp, strncmp
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>       // string, to_string
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX        // or std::min and std::max stop compiling
+#endif
+#include <Windows.h>
+#else
+#include "shader_data.hpp"     // generated by cmake/embed_shaders.cmake
+#endif
+
+namespace gl
+{
+
+struct shader_define
+{
+    std::string name;
+    std::string value;
+};
+
+typedef std::vector<shader_define> shader_defines;
+
+// The text of a shader source, not null-terminated. Owned by the library.
+struct source_text
+{
+    char const* data;
+    std::size_t size;
+};
+
+// Shader sources compiled into the executable, so it runs from any working
+// directory: on Windows as RCDATA resources by shaders.rc, elsewhere as
+// constant arrays in shader_data.hpp, which the build generates from the
+// same files. Either way the text is used in place, not copied. Setting an
+// override directory reads the files from there instead, to iterate on
+// shaders without rebuilding.
+class shader_library {
+public:
+    // An empty directory uses the embedded sources.
+    void set_override_directory(std::string const& directory)
+    {
+        _directory = directory;
+        _sources.clear();
+        _files.clear();
+    }
+
+    // The source of the named shader, e.g. "particle.vert".
+    source_text source(char const* name)
+    {
+        auto it = _sources.find(name);
+        if(it == _sources.end())
+            it = _sources.insert(std::make_pair(std::string(name), load(name))).first;
+        return it->second;
+    }
+
+    // The named shader ready to compile: #include "name" lines replaced by
+    // the included source, once per program, and the defines inserted
+    // after the #version line. #line directives keep the driver's messages
+    // pointing at the original files, numbered in order of inclusion.
+    std::string preprocess(char const* name, shader_defines const& defines)
+    {
+        std::string out;
+        std::set<std::string> included;
+        int files = 0;
+        expand(out, name, defines, included, files);
+        return out;
+    }
+
+private:
+    struct entry
+    {
+        char const* name;
+#if defined(_WIN32)
+        int id;
+#else
+        source_text text;
+#endif
+    };
+
+    source_text load(char const* name)
+    {
+        entry const& embedded = find_entry(name);
+        if(!_directory.empty()) {
+            std::string const& file = _files[name] = read_file((_directory + "/" + name).c_str());
+            source_text text = {file.data(), file.size()};
+            return text;
+        }
+#if defined(_WIN32)
+        // Resources stay mapped for the life of the process.
+        HRSRC info = FindResourceA(nullptr, MAKEINTRESOURCEA(embedded.id), MAKEINTRESOURCEA(10));   // RT_RCDATA
+        HGLOBAL resource = info ? LoadResource(nullptr, info) : nullptr;
+        void const* data = resource ? LockResource(resource) : nullptr;
+        if(!data)
+            throw std::runtime_error(std::string("missing shader resource ") + name);
+        source_text text = {static_cast<char const*>(data), static_cast<std::size_t>(SizeofResource(nullptr, info))};
+        return text;
+#else
+        return embedded.text;
+#endif
+    }
+
+    static bool starts_with(char const* begin, char const* end, char const* prefix)
+    {
+        std::size_t const length = std::strlen(prefix);
+        return static_cast<std::size_t>(end - begin) >= length && std::strncmp(begin, prefix, length) == 0;
+    }
+
+    static void line_directive(std::string& out, int number, int file)
+    {
+        out += "#line ";
+        out += std::to_string(number);
+        out += " ";
+        out += std::to_string(file);
+        out += "\n";
+    }
+
+    // Appends the expansion of name to out. The text is copied line by line
+    // from where it lies, and out grows at most once per file for it.
+    void expand(std::string& out, char const* name, shader_defines const& defines,
+        std::set<std::string>& included, int& files)
+    {
+        int const file = files++;
+        source_text const text = source(name);
+        std::size_t extra = 0;
+        for(auto const& define : defines)
+            extra += define.name.size() + define.value.size() + 10;
+        out.reserve(out.size() + text.size + extra + 32);
+        char const* const end = text.data + text.size;
+        char const* next = text.data;
+        for(int number = 1; next != end; ++number) {
+            char const* const line = next;
+            char const* const line_end = std::find(line, end, '\n');
+            next = line_end == end ? end : line_end + 1;
+            char const* const first = std::find_if(line, line_end, [](char c) { return c != ' ' && c != '\t'; });
+            if(starts_with(first, line_end, "#include")) {
+                char const* const open = std::find(first + 8, line_end, '"');
+                char const* const close = open == line_end ? line_end : std::find(open + 1, line_end, '"');
+                if(close == line_end)
+                    throw std::runtime_error(std::string(name) + ": malformed " + std::string(line, line_end));
+                std::string const include(open + 1, close);
+                if(included.insert(include).second) {
+                    line_directive(out, 1, files);
+                    expand(out, include.c_str(), shader_defines(), included, files);
+                }
+                line_directive(out, number + 1, file);
+                continue;
+            }
+            out.append(line, line_end);
+            out += '\n';
+            if(starts_with(first, line_end, "#version") && !defines.empty()) {
+                for(auto const& define : defines) {
+                    out += "#define ";
+                    out += define.name;
+                    out += " ";
+                    out += define.value;
+                    out += "\n";
+                }
+                line_directive(out, number + 1, file);
+            }
+        }
+    }
+
+    static entry const& find_entry(char const* name)
+    {
+#if defined(_WIN32)
+#define SHADER_ENTRY(name, id, symbol) {name, id}
+#else
+#define SHADER_ENTRY(name, id, symbol) {name, {shader_data::symbol, sizeof(shader_data::symbol) - 1}}
+#endif
+        static entry const entries[] = {
+            SHADER_ENTRY("particle.vert", IDR_PARTICLE_VERT, particle_vert),
+            SHADER_ENTRY("particle.geom", IDR_PARTICLE_GEOM, particle_geom),
+            SHADER_ENTRY("particle.frag", IDR_PARTICLE_FRAG, particle_frag),
+            SHADER_ENTRY("particle_quad.vert", IDR_PARTICLE_QUAD_VERT, particle_quad_vert),
+            SHADER_ENTRY("particle_quad.frag", IDR_PARTICLE_QUAD_FRAG, particle_quad_frag),
+            SHADER_ENTRY("particle_sprite.vert", IDR_PARTICLE_SPRITE_VERT, particle_sprite_vert),
+            SHADER_ENTRY("particle_sprite.frag", IDR_PARTICLE_SPRITE_FRAG, particle_sprite_frag),
+            SHADER_ENTRY("particle_simulate.vert", IDR_PARTICLE_SIMULATE_VERT, particle_simulate_vert),
+            SHADER_ENTRY("particle_simulate.comp", IDR_PARTICLE_SIMULATE_COMP, particle_simulate_comp),
+            SHADER_ENTRY("density_composite.vert", IDR_DENSITY_COMPOSITE_VERT, density_composite_vert),
+            SHADER_ENTRY("density_composite.frag", IDR_DENSITY_COMPOSITE_FRAG, density_composite_frag),
+            SHADER_ENTRY("particle_common.glsl", IDR_PARTICLE_COMMON_GLSL, particle_common_glsl),
+        };
+#undef SHADER_ENTRY
+        for(auto const& e : entries)
+            if(std::strcmp(e.name, name) == 0)
+                return e;
+        throw std::runtime_error(std::string("unknown shader ") + name);
+    }
+
+    std::string _directory;
+    std::map<std::string, source_text> _sources;
+    std::map<std::string, std::string> _files;      // read from the override directory
+};
+
+// The sources shared by everything that builds programs.
+shader_library& shader_sources()
+{
+    static shader_library library;
+    return library;
+}
+
+shader load_shader(GLenum type, char const* name, shader_defines const& defines = shader_defines())
+{
+    std::string const source = shader_sources().preprocess(name, defines);
+    shader shader(type, source.data(), static_cast<GLint>(source.size()));
+    return shader;
+}
+
+}   // namespace gl
@@ -1,117 +1,815 @@
 #include "vec2.hpp"
+#include "particles.hpp"
+#include "vortex.hpp"
+#include "sph.hpp"
+#include "flip.hpp"
+#include "thread_pool.hpp"
 #include "timer.hpp"
 #include "gl.hpp"
+#include "gpu_simulation.hpp"
+#include "particle_renderer.hpp"
+#include "lod_renderer.hpp"
+#include "software_renderer.hpp"
+#include "density_buffer.hpp"
+#include "viewport_culler.hpp"
+#include "frame_profiler.hpp"
+#include "headless_context.hpp"
+#include "frame_capture.hpp"
+#include "shader_sources.hpp"
 
 #include <stdexcept>
 #include <random>
 #include <iostream>
+#include <cstring>      // memcmp, strcmp, strncmp
+#include <cstdlib>      // strtoul, strtod
+#include <chrono>
+#include <algorithm>    // min
+#include <memory>       // unique_ptr
+#include <fstream>      // ofstream
+#include <string>
+#include <vector>
 
 struct vertex
 {
     vec2 position;
 };
 
+namespace gl
+{
+template <>
+struct vertex_layout<::vertex> : attributes<
+    attribute<vec2, offsetof(::vertex, position)>>
+{
+};
+}
+
 float g_aspect = 1.0f;
+int g_width = 1;
+int g_height = 1;
+float g_density_scale = 0.0f;
+bool g_report_percentiles = false;
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     g_aspect = static_cast<float>(width) / static_cast<float>(height);
-    glViewport(0, 0, width, height);
+    g_width = width;
+    g_height = height;
+    gl::state().viewport(0, 0, width, height);
 }
 
+// [ and ] shrink and grow the density buffer, if one is used. P prints the
+// frame time percentiles so far.
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    float const DENSITY_SCALE_STEP = 0.125f;
+    if(key == GLFW_KEY_P && action == GLFW_PRESS)
+        g_report_percentiles = true;
+    if(g_density_scale == 0.0f || action == GLFW_RELEASE)
+        return;
+    if(key == GLFW_KEY_LEFT_BRACKET)
+        g_density_scale = std::max(density_buffer::MIN_SCALE, g_density_scale - DENSITY_SCALE_STEP);
+    else if(key == GLFW_KEY_RIGHT_BRACKET)
+        g_density_scale = std::min(1.0f, g_density_scale + DENSITY_SCALE_STEP);
+}
+
+unsigned const WINDOW_WIDTH = 640;
+unsigned const WINDOW_HEIGHT = 480;
 std::size_t const N_PARTICLES = 10000;
+std::size_t const VORTEX_STRIDE = 8;        // every n:th particle is a vortex blob
+float const VORTEX_STRENGTH = 0.001f;
+float const HOT_LAYER = -0.4f;              // particles below start hot in FLIP mode
+unsigned const BENCHMARK_FRAMES = 100;
+unsigned const PROFILE_FRAMES = 120;     // between --profile reports
+std::chrono::milliseconds const FRAME_TIME(16);    // window frame pacing
+unsigned const CHECK_FRAMES = 500;
+float const CHECK_TOLERANCE = 1e-3f;
+
+enum class simulation_mode
+{
+    ballistic,
+    vortex,
+    sph,
+    flip
+};
+
+enum class simulation_backend
+{
+    cpu,
+    transform_feedback,
+    compute
+};
 
-void simulate(std::vector<vec2>& positions, std::vector<vec2>& velocities, float dt)
+struct settings
 {
-    float const GRAVITY = 0.05f;
-    for(std::size_t i = 0; i != N_PARTICLES; ++i)
+    settings() :
+        mode(simulation_mode::ballistic),
+        backend(simulation_backend::cpu),
+        renderer(render_mode::geometry),
+        particles(N_PARTICLES),
+        threads(std::thread::hardware_concurrency()),
+        flip_ratio(flip::DEFAULT_FLIP_RATIO),
+        benchmark(false),
+        render_benchmark(false),
+        check_backend(false),
+        check_uploads(false),
+        lod(false),
+        cull(false),
+        profile(false),
+        headless(false),
+        software(false),
+        frames(BENCHMARK_FRAMES),
+        density_scale(0.0f)
     {
-        vec2 pos = positions[i];
-        vec2 acceleration = -pos*GRAVITY;
-        vec2 velocity = velocities[i];
-        velocity += dt*acceleration;
-        pos += dt*velocity;
-        positions[i] = pos;
-        velocities[i] = velocity;
     }
-}
 
-void commit_particles(gl::vertex_buffer<vertex>& vertex_buffer, std::vector<vec2> const& positions)
+    simulation_mode mode;
+    simulation_backend backend;
+    render_mode renderer;
+    particle_variant variant;
+    std::size_t particles;
+    unsigned threads;
+    float flip_ratio;
+    bool benchmark;
+    bool render_benchmark;
+    bool check_backend;
+    bool check_uploads;     // compares partial uploads with the particles
+    bool lod;               // picks the render mode from the particles' size on screen
+    bool cull;              // uploads and draws only the particles on screen
+    bool profile;           // reports CPU and GPU time per frame phase, and pacing
+    bool headless;          // renders offscreen, without a window or display
+    bool software;          // render on the CPU without a window
+    unsigned frames;        // frames to render without a window
+    std::string output;     // image of the last windowless frame, if set
+    std::string capture;    // saves every frame as <capture>NNNNNN.ppm, if set
+    float density_scale;    // 0 draws directly into the window
+    std::string shader_cache;   // program binary directory, if set
+    std::string shader_dir;     // reads shader sources from here, if set
+};
+
+bool parse_settings(int argc, char* argv[], settings& result)
 {
-    auto&& vertices = vertex_buffer.map();
-    static_assert(sizeof(vertex) == sizeof(positions[0]), "vertex size does not match position size");
-    std::memcpy(vertices.data(), positions.data(), sizeof(vertex)*N_PARTICLES);
+    for(int i = 1; i != argc; ++i)
+    {
+        char const* arg = argv[i];
+        if(std::strcmp(arg, "--vortex") == 0) {
+            result.mode = simulation_mode::vortex;
+        } else if(std::strcmp(arg, "--sph") == 0) {
+            result.mode = simulation_mode::sph;
+        } else if(std::strcmp(arg, "--flip") == 0) {
+            result.mode = simulation_mode::flip;
+        } else if(std::strncmp(arg, "--flip-ratio=", 13) == 0) {
+            result.flip_ratio = static_cast<float>(std::strtod(arg + 13, nullptr));
+        } else if(std::strcmp(arg, "--backend=cpu") == 0) {
+            result.backend = simulation_backend::cpu;
+        } else if(std::strcmp(arg, "--backend=transform-feedback") == 0) {
+            result.backend = simulation_backend::transform_feedback;
+        } else if(std::strcmp(arg, "--backend=compute") == 0) {
+            result.backend = simulation_backend::compute;
+        } else if(std::strcmp(arg, "--check-backend") == 0) {
+            result.check_backend = true;
+        } else if(std::strcmp(arg, "--check-uploads") == 0) {
+            result.check_uploads = true;
+        } else if(std::strcmp(arg, "--renderer=geometry") == 0) {
+            result.renderer = render_mode::geometry;
+        } else if(std::strcmp(arg, "--renderer=instanced") == 0) {
+            result.renderer = render_mode::instanced;
+        } else if(std::strcmp(arg, "--renderer=sprite") == 0) {
+            result.renderer = render_mode::sprite;
+        } else if(std::strcmp(arg, "--renderer=lod") == 0) {
+            result.lod = true;
+        } else if(std::strcmp(arg, "--renderer=software") == 0) {
+            result.software = true;
+        } else if(std::strncmp(arg, "--particle-radius=", 18) == 0) {
+            result.variant.radius = static_cast<float>(std::strtod(arg + 18, nullptr));
+            if(!(result.variant.radius > 0.0f && result.variant.radius <= 1.0f)) {
+                std::cerr << "--particle-radius must be in (0, 1]" << std::endl;
+                return false;
+            }
+        } else if(std::strncmp(arg, "--segments=", 11) == 0) {
+            result.variant.segments = static_cast<unsigned>(std::strtoul(arg + 11, nullptr, 10));
+            if(result.variant.segments < particle_variant::MIN_SEGMENTS
+                || result.variant.segments > particle_variant::MAX_SEGMENTS) {
+                std::cerr << "--segments must be in [" << particle_variant::MIN_SEGMENTS << ", "
+                    << particle_variant::MAX_SEGMENTS << "]" << std::endl;
+                return false;
+            }
+        } else if(std::strcmp(arg, "--falloff=linear") == 0) {
+            result.variant.falloff = falloff_curve::linear;
+        } else if(std::strcmp(arg, "--falloff=quadratic") == 0) {
+            result.variant.falloff = falloff_curve::quadratic;
+        } else if(std::strcmp(arg, "--falloff=smooth") == 0) {
+            result.variant.falloff = falloff_curve::smooth;
+        } else if(std::strncmp(arg, "--frames=", 9) == 0) {
+            result.frames = static_cast<unsigned>(std::strtoul(arg + 9, nullptr, 10));
+        } else if(std::strncmp(arg, "--output=", 9) == 0) {
+            result.output = arg + 9;
+        } else if(std::strncmp(arg, "--capture=", 10) == 0) {
+            result.capture = arg + 10;
+        } else if(std::strncmp(arg, "--density-scale=", 16) == 0) {
+            result.density_scale = static_cast<float>(std::strtod(arg + 16, nullptr));
+            if(!(result.density_scale > 0.0f && result.density_scale <= 1.0f)) {
+                std::cerr << "--density-scale must be in (0, 1]" << std::endl;
+                return false;
+            }
+        } else if(std::strncmp(arg, "--shader-cache=", 15) == 0) {
+            result.shader_cache = arg + 15;
+        } else if(std::strncmp(arg, "--shader-dir=", 13) == 0) {
+            result.shader_dir = arg + 13;
+        } else if(std::strcmp(arg, "--cull") == 0) {
+            result.cull = true;
+        } else if(std::strcmp(arg, "--headless") == 0) {
+            result.headless = true;
+        } else if(std::strcmp(arg, "--profile") == 0) {
+            result.profile = true;
+        } else if(std::strcmp(arg, "--render-benchmark") == 0) {
+            result.render_benchmark = true;
+        } else if(std::strcmp(arg, "--benchmark") == 0) {
+            result.benchmark = true;
+        } else if(std::strncmp(arg, "--particles=", 12) == 0) {
+            result.particles = std::strtoul(arg + 12, nullptr, 10);
+        } else if(std::strncmp(arg, "--threads=", 10) == 0) {
+            result.threads = static_cast<unsigned>(std::strtoul(arg + 10, nullptr, 10));
+        } else {
+            std::cerr << "unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    if(result.backend != simulation_backend::cpu && result.mode != simulation_mode::ballistic) {
+        std::cerr << "GPU backends only support the ballistic simulation" << std::endl;
+        return false;
+    }
+    if(result.check_uploads && result.backend != simulation_backend::cpu) {
+        std::cerr << "--check-uploads needs the CPU backend" << std::endl;
+        return false;
+    }
+    if(result.cull && result.backend != simulation_backend::cpu) {
+        std::cerr << "culling needs the CPU backend" << std::endl;
+        return false;
+    }
+    if(result.software && result.backend != simulation_backend::cpu) {
+        std::cerr << "the software renderer needs the CPU backend" << std::endl;
+        return false;
+    }
+    return true;
 }
 
+typedef particles::store<
+    particles::position,
+    particles::velocity,
+    particles::age,
+    particles::temperature,
+    particles::density,
+    particles::color,
+    particles::circulation> particle_store;
 
+struct integrate
+{
+    typedef particles::reads<> reads;
+    typedef particles::writes<particles::position, particles::velocity, particles::age> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        float const GRAVITY = 0.05f;
+        auto positions = view.template get<particles::position>();
+        auto velocities = view.template get<particles::velocity>();
+        auto ages = view.template get<particles::age>();
+        for(std::size_t i = begin; i != end; ++i)
+        {
+            vec2 pos = positions[i];
+            vec2 acceleration = -pos*GRAVITY;
+            vec2 velocity = velocities[i];
+            velocity += dt*acceleration;
+            pos += dt*velocity;
+            positions[i] = pos;
+            velocities[i] = velocity;
+            ages[i] += dt;
+        }
+    }
 
-int main()
+    float dt;
+};
+
+struct solvers
 {
-    gl::glfw_context glfw;
-    
-    auto window = glfwCreateWindow(640, 480, "Hello World", nullptr, nullptr);
-    if(!window)
-        return 1;
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    framebuffer_size_callback(window, 640, 480);
+    solvers(settings const& settings, thread_pool& pool) :
+        sph_solver(pool),
+        flip_solver(pool)
+    {
+        flip_solver.set_flip_ratio(settings.flip_ratio);
+    }
 
-    GLenum err = glewInit();
-    if(GLEW_OK != err)
-        return 1;
+    vortex::tree vortex_tree;
+    sph::solver sph_solver;
+    flip::solver flip_solver;
+};
 
+void simulate(settings const& settings, solvers& solvers, particle_store& store, float dt)
+{
+    switch(settings.mode)
+    {
+    case simulation_mode::ballistic:
+        store.run(integrate{dt});
+        break;
+    case simulation_mode::vortex:
+        vortex::simulate(store, solvers.vortex_tree, dt);
+        break;
+    case simulation_mode::sph:
+        solvers.sph_solver.simulate(store, dt);
+        break;
+    case simulation_mode::flip:
+        solvers.flip_solver.simulate(store, dt);
+        break;
+    }
+}
+
+void initialize_particles(settings const& settings, particle_store& store)
+{
     std::mt19937 rng_engine;
     std::uniform_real_distribution<float> rng(-1.0f, 1.0f);
-    std::vector<vec2> positions(N_PARTICLES);
-    std::vector<vec2> velocities(N_PARTICLES);
-    for(std::size_t i = 0; i != N_PARTICLES; ++i)
+    auto positions = store.data<particles::position>();
+    auto velocities = store.data<particles::velocity>();
+    auto colors = store.data<particles::color>();
+    auto circulations = store.data<particles::circulation>();
+    auto temperatures = store.data<particles::temperature>();
+    for(std::size_t i = 0; i != store.size(); ++i)
     {
         positions[i] = 0.75f*vec2(rng(rng_engine), rng(rng_engine));
         velocities[i] = 0.1f*rng(rng_engine)*normalize(vec2(rng(rng_engine), rng(rng_engine)));
+        colors[i] = 0xffffffff;
+        // Opposite-signed blobs on either side of x=0 form a shear layer
+        // that rolls up.
+        if(settings.mode == simulation_mode::vortex && i % VORTEX_STRIDE == 0)
+            circulations[i] = positions[i].x < 0.0f ? VORTEX_STRENGTH : -VORTEX_STRENGTH;
+        if(settings.mode == simulation_mode::flip && positions[i].y < HOT_LAYER)
+            temperatures[i] = 1.0f;
+    }
+}
+
+// Times the simulation alone, without a window, for 1, 2, 4, ... threads up
+// to settings.threads.
+int run_benchmark(settings const& settings)
+{
+    typedef std::chrono::high_resolution_clock clock;
+    typedef std::chrono::duration<double, std::milli> ms;
+    float const dt = static_cast<float>(1.0)/16;
+    unsigned const max_threads = std::max(1u, settings.threads);
+    for(unsigned threads = 1;; threads = std::min(max_threads, threads*2))
+    {
+        thread_pool pool(threads);
+        solvers solvers(settings, pool);
+        particle_store store(settings.particles);
+        initialize_particles(settings, store);
+
+        double scatter = 0.0;
+        auto start = clock::now();
+        for(unsigned frame = 0; frame != BENCHMARK_FRAMES; ++frame) {
+            simulate(settings, solvers, store, dt);
+            scatter += solvers.flip_solver.last_timings().scatter;
+        }
+        double total = ms(clock::now() - start).count();
+
+        std::cout << threads << " threads: " << total/BENCHMARK_FRAMES << " ms/frame";
+        if(settings.mode == simulation_mode::flip)
+            std::cout << ", scatter " << scatter/BENCHMARK_FRAMES << " ms";
+        std::cout << std::endl;
+        if(threads == max_threads)
+            break;
+    }
+    return 0;
+}
+
+// Uploads the positions written since the last commit.
+// Uploads the chunks of positions written since the last commit and
+// returns how many vertices that was.
+std::size_t commit_particles(gl::vertex_buffer<vertex>& vertex_buffer, particle_store& store)
+{
+    static_assert(sizeof(vertex) == sizeof(particles::position::value_type), "vertex size does not match position size");
+    auto const& source = store;
+    auto vertices = reinterpret_cast<vertex const*>(source.data<particles::position>());
+    std::size_t uploaded = 0;
+    store.dirty<particles::position>().consume([&](std::size_t begin, std::size_t end) {
+        vertex_buffer.sub_data(static_cast<GLsizei>(begin), static_cast<GLsizei>(end - begin), vertices + begin);
+        uploaded += end - begin;
+    });
+    return uploaded;
+}
+
+// Uploads only the particles that can touch the viewport, packed at the
+// start of the buffer, and returns how many there are.
+GLsizei commit_visible(gl::vertex_buffer<vertex>& vertex_buffer, particle_store& store,
+    viewport_culler& culler, float radius)
+{
+    auto const& source = store;
+    vec2 const* positions = source.data<particles::position>();
+    std::size_t visible = culler.count(positions, store.size(), radius, radius*g_aspect);
+    // The packed order changes every frame, so everything is rewritten.
+    store.dirty<particles::position>().consume([](std::size_t, std::size_t) {});
+    if(visible != 0) {
+        auto map = vertex_buffer.map(0, static_cast<GLsizei>(visible),
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        culler.compact(positions, reinterpret_cast<vec2*>(map.data()));
+    }
+    return static_cast<GLsizei>(visible);
+}
+
+// Writes the bound framebuffer's colour as a binary PPM, top row first.
+bool save_framebuffer(std::string const& path, int width, int height)
+{
+    std::vector<unsigned char> pixels(3*width*height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    GL_CHECK_ERROR();
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out << "P6\n" << width << " " << height << "\n255\n";
+    for(int y = height; y-- != 0;)
+        out.write(reinterpret_cast<char const*>(&pixels[3*width*y]), 3*width);
+    return static_cast<bool>(out);
+}
+
+// Prints how closely the timer met its frame deadlines since the last report
+// and how much of each frame it spent spinning, then starts over.
+void report_pacing(class timer& timer, std::ostream& out)
+{
+    timer::statistics_type const pacing = timer.statistics();
+    unsigned const frames = pacing.sleeps + pacing.missed;
+    if(frames != 0) {
+        out << "pacing: slack " << pacing.slack.count()*1e-3 << " us, spin "
+            << pacing.spin.count()*1e-3/frames << " us/frame, late "
+            << pacing.late_mean*1e-3 << " us (sd " << pacing.late_deviation*1e-3 << " us), missed "
+            << pacing.missed << " of " << frames << std::endl;
+    }
+    timer.reset_statistics();
+}
+
+// Draws one frame of count particles, through the density buffer if set.
+template <class Renderer>
+void render_frame(Renderer& renderer, std::size_t count, density_buffer* density)
+{
+    glClear(GL_COLOR_BUFFER_BIT);
+    if(density)
+        density->begin(g_width, g_height);
+    gl::state().blend(true);
+    renderer.draw(static_cast<GLsizei>(count), g_aspect);
+    if(density)
+        density->end(g_width, g_height);
+}
+
+template <class Renderer>
+void benchmark_renderer(char const* name, Renderer& renderer, std::size_t count, density_buffer* density)
+{
+    typedef std::chrono::high_resolution_clock clock;
+    typedef std::chrono::duration<double> seconds;
+    render_frame(renderer, count, density);     // warm up
+    glFinish();
+    auto start = clock::now();
+    for(unsigned frame = 0; frame != BENCHMARK_FRAMES; ++frame)
+        render_frame(renderer, count, density);
+    glFinish();
+    double total = seconds(clock::now() - start).count();
+    std::cout << name << ": " << total*1000.0/BENCHMARK_FRAMES << " ms/frame, "
+        << count*BENCHMARK_FRAMES/total/1e6 << " M particles/s" << std::endl;
+}
+
+// Draws the current particle positions BENCHMARK_FRAMES times with every
+// render mode, then with the one level of detail picks, and reports the
+// throughput. Positions must already be bound as attribute 0; nothing is
+// simulated or presented. With a density buffer every frame goes through it.
+int run_render_benchmark(std::size_t count, particle_variant const& variant, density_buffer* density)
+{
+    render_mode const modes[] = {render_mode::geometry, render_mode::instanced, render_mode::sprite};
+    char const* const names[] = {"geometry", "instanced", "sprite"};
+    gl::state().blend_func(GL_ONE, GL_ONE);
+    for(std::size_t m = 0; m != sizeof(modes)/sizeof(modes[0]); ++m) {
+        particle_renderer renderer(modes[m], variant);
+        benchmark_renderer(names[m], renderer, count, density);
     }
+    lod_renderer lod(variant);
+    benchmark_renderer("lod", lod, count, density);
+    std::cout << "lod picked " << names[static_cast<int>(lod.mode())] << std::endl;
+    return 0;
+}
 
-    gl::vertex_buffer<vertex> vertex_buffer(N_PARTICLES);
-    gl::program program;
-    program
-        .attach(gl::load_shader(GL_VERTEX_SHADER, "src\\particle.vert"))
-        .attach(gl::load_shader(GL_GEOMETRY_SHADER, "src\\particle.geom"))
-        .attach(gl::load_shader(GL_FRAGMENT_SHADER, "src\\particle.frag"))
-        .link();
+// Simulates and renders settings.frames frames on the CPU alone, without a
+// window or GL context, and optionally saves the last one.
+int run_software(settings const& settings)
+{
+    typedef std::chrono::high_resolution_clock clock;
+    typedef std::chrono::duration<double, std::milli> ms;
+    float const dt = static_cast<float>(1.0)/16;
+    particle_store store(settings.particles);
+    initialize_particles(settings, store);
+    thread_pool pool(settings.threads);
+    solvers solvers(settings, pool);
+    software_renderer renderer(WINDOW_WIDTH, WINDOW_HEIGHT, pool, settings.variant);
+    float const aspect = static_cast<float>(WINDOW_WIDTH)/WINDOW_HEIGHT;
 
-    glEnableVertexAttribArray(0);
-    gl::check_error();
+    double simulation = 0.0;
+    double rendering = 0.0;
+    for(unsigned frame = 0; frame != settings.frames; ++frame) {
+        auto start = clock::now();
+        simulate(settings, solvers, store, dt);
+        auto simulated = clock::now();
+        particle_store const& source = store;
+        renderer.render(source.data<particles::position>(), store.size(), aspect);
+        simulation += ms(simulated - start).count();
+        rendering += ms(clock::now() - simulated).count();
+    }
+    if(settings.frames != 0) {
+        std::cout << "simulation " << simulation/settings.frames << " ms/frame, rendering "
+            << rendering/settings.frames << " ms/frame" << std::endl;
+    }
+    if(!settings.output.empty()) {
+        std::ofstream out(settings.output.c_str(), std::ios::binary);
+        renderer.write_ppm(out);
+        if(!out) {
+            std::cerr << "cannot write " << settings.output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs the CPU and the selected GPU backend side by side from the same
+// initial state and reports the largest position difference.
+int check_backend(settings const& settings, gpu_simulation& backend, particle_store& store, solvers& solvers)
+{
+    float const dt = static_cast<float>(1.0)/16;
+    for(unsigned frame = 0; frame != CHECK_FRAMES; ++frame) {
+        simulate(settings, solvers, store, dt);
+        backend.simulate(dt);
+    }
+    particle_store gpu_store(store.size());
+    backend.download(gpu_store.data<particles::position>(), gpu_store.data<particles::velocity>());
+
+    float max_error = 0.0f;
+    auto cpu_positions = store.data<particles::position>();
+    auto gpu_positions = gpu_store.data<particles::position>();
+    for(std::size_t i = 0; i != store.size(); ++i) {
+        vec2 d = cpu_positions[i] + -gpu_positions[i];
+        max_error = std::max(max_error, std::sqrt(dot(d, d)));
+    }
+    std::cout << "max position error after " << CHECK_FRAMES << " frames: " << max_error << std::endl;
+    return max_error <= CHECK_TOLERANCE ? 0 : 1;
+}
+
+// Simulates and commits settings.frames frames, reading the vertex buffer back
+// after each to make sure the dirty chunks uploaded leave it equal to the
+// particles, as a full upload would. Reports how much was uploaded.
+int check_uploads(settings const& settings, gl::vertex_buffer<vertex>& vertex_buffer,
+    particle_store& store, solvers& solvers)
+{
+    float const dt = static_cast<float>(1.0)/16;
+    auto const& source = store;
+    std::vector<vertex> readback(store.size());
+    std::size_t uploaded = commit_particles(vertex_buffer, store);
+    std::size_t mismatched = 0;
+    for(unsigned frame = 0; frame != settings.frames; ++frame) {
+        simulate(settings, solvers, store, dt);
+        uploaded += commit_particles(vertex_buffer, store);
+        vertex_buffer.get_sub_data(0, static_cast<GLsizei>(readback.size()), readback.data());
+        if(std::memcmp(readback.data(), source.data<particles::position>(), readback.size()*sizeof(vertex)) != 0)
+            ++mismatched;
+    }
+    std::cout << "uploaded " << 100.0*uploaded/(store.size()*(settings.frames + 1.0)) << "% of the vertices in "
+        << settings.frames << " frames, " << mismatched << " frames differ from a full upload" << std::endl;
+    return mismatched == 0 ? 0 : 1;
+}
+
+// Runs the simulation and renderer in the current context: in window until
+// it is closed, paced to the frame rate, or without one for settings.frames
+// frames as fast as possible into the bound framebuffer.
+int run(settings const& settings, GLFWwindow* window)
+{
+    gl::enable_debug_output();
+    gl::shader_sources().set_override_directory(settings.shader_dir);
+
+    particle_store store(settings.particles);
+    initialize_particles(settings, store);
+    thread_pool pool(settings.threads);
+    solvers solvers(settings, pool);
+
+    std::unique_ptr<gpu_simulation> gpu;
+    switch(settings.backend)
+    {
+    case simulation_backend::cpu:
+        break;
+    case simulation_backend::transform_feedback:
+        gpu.reset(new transform_feedback_simulation(store));
+        break;
+    case simulation_backend::compute:
+        if(!GLEW_VERSION_4_3) {
+            std::cerr << "the compute backend needs OpenGL 4.3" << std::endl;
+            return 1;
+        }
+        gpu.reset(new compute_simulation(store));
+        break;
+    }
+    if(settings.check_backend) {
+        if(!gpu) {
+            std::cerr << "--check-backend needs a GPU backend" << std::endl;
+            return 1;
+        }
+        return check_backend(settings, *gpu, store, solvers);
+    }
+
+    gl::vertex_buffer<vertex> vertex_buffer(static_cast<GLsizei>(store.size()), GL_STREAM_DRAW);
+    if(settings.check_uploads)
+        return check_uploads(settings, vertex_buffer, store, solvers);
+    gl::programs().set_directory(settings.shader_cache);
+    auto programs_start = std::chrono::high_resolution_clock::now();
+    std::unique_ptr<particle_renderer> renderer;
+    std::unique_ptr<lod_renderer> lod;
+    if(settings.lod)
+        lod.reset(new lod_renderer(settings.variant));
+    else
+        renderer.reset(new particle_renderer(settings.renderer, settings.variant));
+    std::unique_ptr<density_buffer> density;
+    if(settings.density_scale > 0.0f) {
+        density.reset(new density_buffer(settings.density_scale));
+        g_density_scale = density->scale();
+    }
+    if(gl::programs().enabled()) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - programs_start;
+        std::cout << "programs ready in " << elapsed.count() << " ms (" << gl::programs().hits()
+            << " cached, " << gl::programs().misses() << " compiled)" << std::endl;
+    }
+
+    // The CPU path's layout is fixed; GPU backends may swap buffers every
+    // frame and point attribute 0 at the current one in bind_positions().
+    gl::vertex_array vertex_array;
+    if(gpu) {
+        vertex_array.bind();
+        glEnableVertexAttribArray(0);
+        GL_CHECK_ERROR();
+    } else {
+        vertex_array.attach(vertex_buffer);
+    }
+
+    if(settings.render_benchmark) {
+        if(gpu)
+            gpu->bind_positions();
+        else
+            commit_particles(vertex_buffer, store);
+        return run_render_benchmark(store.size(), settings.variant, density.get());
+    }
 
-    program.use();
     glDisable(GL_CULL_FACE);
     //glCullFace(GL_BACK);
 
-    auto aspect_location = program.uniform_location("g_aspect");
+    std::unique_ptr<viewport_culler> culler;
+    if(settings.cull)
+        culler.reset(new viewport_culler(pool));
+
+    // Frames are the window's initial size; capture stops if it changes.
+    std::unique_ptr<frame_capture> capture;
+    if(!settings.capture.empty())
+        capture.reset(new frame_capture(g_width, g_height, settings.capture));
 
     class timer timer;
-    unsigned frame_time = 0;
-    while(!glfwWindowShouldClose(window)) {
-        simulate(positions, velocities, static_cast<float>(1.0)/16);
+    frame_profiler profiler(timer, settings.profile, {"simulate", "commit", "draw", "swap", "sleep"},
+        {"simulate", "clear", "upload", "draw", "composite"});
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        gl::check_error();
-        glUniform1f(aspect_location, g_aspect);
-        gl::check_error();
+    timer::duration frame_time(0);
+    unsigned frame = 0;
+    while(window ? !glfwWindowShouldClose(window) : frame != settings.frames) {
+        profiler.begin_frame();
+        float const dt = static_cast<float>(1.0)/16;
+        if(gpu)
+            gpu->simulate(dt);
+        else
+            simulate(settings, solvers, store, dt);
+        profiler.end_phase();
+        // GPU backends do their work here; on the CPU backend this pass is
+        // empty.
+        profiler.end_pass();
 
-        vertex_buffer.bind();
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, vertex_buffer.stride, nullptr);
-        gl::check_error();
-        commit_particles(vertex_buffer, positions);
+        // The density composite overwrites the whole window.
+        if(!density) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            GL_CHECK_ERROR();
+        }
+        profiler.end_pass();
 
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_ONE, GL_ONE);
+        GLsizei drawn = static_cast<GLsizei>(store.size());
+        if(gpu)
+            gpu->bind_positions();
+        else if(culler)
+            drawn = commit_visible(vertex_buffer, store, *culler, settings.variant.radius);
+        else
+            commit_particles(vertex_buffer, store);
+        profiler.end_phase();
+        profiler.end_pass();
 
-        glDrawArrays(GL_POINTS, 0, N_PARTICLES);
-        gl::check_error();
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if(density) {
+            density->set_scale(g_density_scale);
+            density->begin(g_width, g_height);
+        }
+        gl::state().blend(true);
+        gl::state().blend_func(GL_ONE, GL_ONE);
+        if(lod)
+            lod->draw(drawn, g_aspect);
+        else
+            renderer->draw(drawn, g_aspect);
+        profiler.end_pass();
+        if(density)
+            density->end(g_width, g_height);
+        profiler.end_pass();
+        if(capture && capture->width() == g_width && capture->height() == g_height)
+            capture->capture();
+        profiler.end_phase();
 
-        frame_time += 16;
-        timer.sleep_until(frame_time);
+        if(window) {
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+        profiler.end_phase();
+
+        ++frame;
+        if(window) {
+            frame_time += FRAME_TIME;
+            timer.sleep_until(frame_time);
+        }
+        profiler.end_phase();
+        profiler.end_frame();
+        if(profiler.frames() == PROFILE_FRAMES) {
+            profiler.report(std::cout);
+            report_pacing(timer, std::cout);
+        }
+        if(g_report_percentiles) {
+            profiler.report_percentiles(std::cout);
+            g_report_percentiles = false;
+        }
+    }
+    profiler.report(std::cout);
+    if(settings.profile)
+        report_pacing(timer, std::cout);
+    profiler.report_percentiles(std::cout);
+    if(capture) {
+        capture->finish();
+        std::cout << "captured " << capture->frames() - capture->dropped() << " frames, dropped "
+            << capture->dropped() << std::endl;
+        if(capture->failed()) {
+            std::cerr << "cannot write " << settings.capture << "*.ppm" << std::endl;
+            return 1;
+        }
+    }
+    if(window)
+        return 0;
+
+    glFinish();
+    std::chrono::duration<double, std::milli> elapsed = timer.get();
+    if(frame != 0)
+        std::cout << frame << " frames, " << elapsed.count()/frame << " ms/frame" << std::endl;
+    if(!settings.output.empty() && !save_framebuffer(settings.output, g_width, g_height)) {
+        std::cerr << "cannot write " << settings.output << std::endl;
+        return 1;
     }
     return 0;
 }
+
+// Renders into a framebuffer object of a context that needs no display.
+int run_headless(settings const& settings)
+{
+    gl::headless_context context(gl::strict_errors);
+    GLenum err = glewInit();
+    if(GLEW_OK != err)
+        return 1;
+    gl::texture color;
+    color.image(GL_RGBA8, WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE);
+    gl::framebuffer target;
+    target.attach(GL_COLOR_ATTACHMENT0, color);
+    framebuffer_size_callback(nullptr, WINDOW_WIDTH, WINDOW_HEIGHT);
+    return run(settings, nullptr);
+}
+
+int main(int argc, char* argv[])
+{
+    settings settings;
+    if(!parse_settings(argc, argv, settings))
+        return 1;
+    if(settings.benchmark)
+        return run_benchmark(settings);
+    if(settings.software)
+        return run_software(settings);
+    if(settings.headless)
+        return run_headless(settings);
+
+    gl::glfw_context glfw;
+    if(gl::strict_errors)
+        glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+
+    auto window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Hello World", nullptr, nullptr);
+    if(!window)
+        return 1;
+    glfwMakeContextCurrent(window);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetKeyCallback(window, key_callback);
+    framebuffer_size_callback(window, WINDOW_WIDTH, WINDOW_HEIGHT);
+
+    GLenum err = glewInit();
+    if(GLEW_OK != err)
+        return 1;
+    return run(settings, window);
+}
+
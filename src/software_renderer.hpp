@@ -0,0 +1,207 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "aligned_allocator.hpp"
+#include "thread_pool.hpp"
+#include "particle_variant.hpp"
+
+#include <algorithm>    // min, max, fill
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include <xmmintrin.h>
+
+// Renders particles on the CPU, for machines without a GPU. Produces the
+// image of the instanced and sprite GL paths: discs of the variant's radius
+// (scaled by the aspect ratio vertically, in NDC) and falloff, blended
+// additively. The framebuffer is float, so unlike an RGBA8
+// target it does not round every fragment to 1/255.
+//
+// The framebuffer is stored tile by tile. Each frame the particles are
+// binned per tile, then tiles are rasterized in parallel, four pixels of a
+// row at a time.
+class software_renderer
+{
+public:
+    static unsigned const TILE_SIZE = 64;   // pixels; a multiple of 4
+    static std::size_t const GRAIN = 16384; // particles per binning chunk
+
+    software_renderer(unsigned width, unsigned height, thread_pool& pool,
+        particle_variant const& variant = particle_variant()) :
+        _variant(variant),
+        _width(width),
+        _height(height),
+        _tiles_x((width + TILE_SIZE - 1)/TILE_SIZE),
+        _tiles_y((height + TILE_SIZE - 1)/TILE_SIZE),
+        _pool(pool),
+        _radius_x(0.0f),
+        _radius_y(0.0f),
+        _pixels(static_cast<std::size_t>(_tiles_x)*_tiles_y*TILE_SIZE*TILE_SIZE, 0.0f),
+        _chunks(0)
+    {
+    }
+
+    unsigned width() const
+    {
+        return _width;
+    }
+
+    unsigned height() const
+    {
+        return _height;
+    }
+
+    // Clears the framebuffer and draws count particles at the given NDC
+    // positions; aspect is width/height as for the g_aspect uniform.
+    void render(vec2 const* positions, std::size_t count, float aspect)
+    {
+        _radius_x = _variant.radius*0.5f*_width;
+        _radius_y = _variant.radius*aspect*0.5f*_height;
+
+        // Bins are kept per chunk of particles rather than per thread, so
+        // every tile adds its particles in index order and the result does
+        // not depend on the scheduling.
+        std::size_t const tiles = static_cast<std::size_t>(_tiles_x)*_tiles_y;
+        std::size_t const chunks = (count + GRAIN - 1)/GRAIN;
+        _discs.resize(count);
+        if(_bins.size() < chunks*tiles)
+            _bins.resize(chunks*tiles);
+        _chunks = chunks;
+        _pool.parallel_for(count, GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t chunk = begin/GRAIN; chunk*GRAIN < end; ++chunk)
+                bin(positions, chunk, std::max(begin, chunk*GRAIN), std::min(end, (chunk + 1)*GRAIN));
+        });
+        _pool.parallel_for(tiles, 1, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t tile = begin; tile != end; ++tile)
+                rasterize(static_cast<unsigned>(tile));
+        });
+    }
+
+    // Pixel (x, y) with y = 0 at the bottom, as in GL.
+    float pixel(unsigned x, unsigned y) const
+    {
+        unsigned tile = (y/TILE_SIZE)*_tiles_x + x/TILE_SIZE;
+        return _pixels[(static_cast<std::size_t>(tile)*TILE_SIZE + y % TILE_SIZE)*TILE_SIZE + x % TILE_SIZE];
+    }
+
+    // Writes a binary grey PPM, top row first, clamped to [0, 1] like an
+    // 8-bit framebuffer.
+    void write_ppm(std::ostream& out) const
+    {
+        out << "P6\n" << _width << " " << _height << "\n255\n";
+        std::vector<unsigned char> row(3*_width);
+        for(unsigned y = _height; y-- != 0;) {
+            for(unsigned x = 0; x != _width; ++x) {
+                float v = std::max(0.0f, std::min(1.0f, pixel(x, y)));
+                row[3*x] = row[3*x + 1] = row[3*x + 2] = static_cast<unsigned char>(v*255.0f + 0.5f);
+            }
+            out.write(reinterpret_cast<char const*>(row.data()), row.size());
+        }
+    }
+
+private:
+    // Centre in pixels and the inclusive pixel bounds of a particle.
+    struct disc
+    {
+        float x, y;
+        int x0, y0, x1, y1;
+    };
+
+    void bin(vec2 const* positions, std::size_t chunk, std::size_t begin, std::size_t end)
+    {
+        int const tile_size = static_cast<int>(TILE_SIZE);
+        std::vector<std::uint32_t>* bins = &_bins[chunk*_tiles_x*_tiles_y];
+        for(unsigned tile = 0; tile != _tiles_x*_tiles_y; ++tile)
+            bins[tile].clear();
+        for(std::size_t i = begin; i != end; ++i) {
+            disc& d = _discs[i];
+            d.x = (positions[i].x + 1.0f)*0.5f*_width;
+            d.y = (positions[i].y + 1.0f)*0.5f*_height;
+            // Discs entirely off screen are dropped before any conversion to
+            // int, which is undefined for huge values; NaNs compare false
+            // and are dropped too. What is left is within a radius of the
+            // screen.
+            if(!(d.x + _radius_x >= 0.0f && d.x - _radius_x < _width
+                && d.y + _radius_y >= 0.0f && d.y - _radius_y < _height))
+                continue;
+            // Pixel centres are at +0.5; only those strictly inside count.
+            d.x0 = std::max(0, static_cast<int>(std::floor(d.x - _radius_x)));
+            d.y0 = std::max(0, static_cast<int>(std::floor(d.y - _radius_y)));
+            d.x1 = std::min(static_cast<int>(_width) - 1, static_cast<int>(std::floor(d.x + _radius_x)));
+            d.y1 = std::min(static_cast<int>(_height) - 1, static_cast<int>(std::floor(d.y + _radius_y)));
+            if(d.x0 > d.x1 || d.y0 > d.y1)
+                continue;
+            for(int ty = d.y0/tile_size; ty <= d.y1/tile_size; ++ty)
+                for(int tx = d.x0/tile_size; tx <= d.x1/tile_size; ++tx)
+                    bins[ty*_tiles_x + tx].push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+
+    // As in particle_common.glsl.
+    __m128 falloff(__m128 distance) const
+    {
+        switch(_variant.falloff)
+        {
+        case falloff_curve::quadratic:
+            return _mm_mul_ps(distance, distance);
+        case falloff_curve::smooth:
+            return _mm_mul_ps(_mm_mul_ps(distance, distance),
+                _mm_sub_ps(_mm_set1_ps(3.0f), _mm_add_ps(distance, distance)));
+        default:
+            return distance;
+        }
+    }
+
+    void rasterize(unsigned tile)
+    {
+        float* pixels = &_pixels[static_cast<std::size_t>(tile)*TILE_SIZE*TILE_SIZE];
+        std::fill(pixels, pixels + TILE_SIZE*TILE_SIZE, 0.0f);
+        int const tile_x = static_cast<int>(tile % _tiles_x*TILE_SIZE);
+        int const tile_y = static_cast<int>(tile/_tiles_x*TILE_SIZE);
+        int const tile_end = static_cast<int>(TILE_SIZE) - 1;
+        std::size_t const tiles = static_cast<std::size_t>(_tiles_x)*_tiles_y;
+
+        __m128 const one = _mm_set1_ps(1.0f);
+        __m128 const zero = _mm_setzero_ps();
+        __m128 const lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        __m128 const inv_radius_x = _mm_set1_ps(1.0f/_radius_x);
+        float const inv_radius_y = 1.0f/_radius_y;
+        for(std::size_t chunk = 0; chunk != _chunks; ++chunk) {
+            for(std::uint32_t i : _bins[chunk*tiles + tile]) {
+                disc const& d = _discs[i];
+                int const x0 = std::max(d.x0 - tile_x, 0) & ~3;
+                int const x1 = std::min(d.x1 - tile_x, tile_end);
+                int const y0 = std::max(d.y0 - tile_y, 0);
+                int const y1 = std::min(d.y1 - tile_y, tile_end);
+                __m128 const cx = _mm_set1_ps(d.x - tile_x);
+                for(int y = y0; y <= y1; ++y) {
+                    float dy = (y + 0.5f - (d.y - tile_y))*inv_radius_y;
+                    __m128 const dy2 = _mm_set1_ps(dy*dy);
+                    float* row = pixels + y*TILE_SIZE;
+                    for(int x = x0; x <= x1; x += 4) {
+                        __m128 dx = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lane), cx),
+                            inv_radius_x);
+                        __m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2));
+                        __m128 v = falloff(_mm_max_ps(zero, _mm_sub_ps(one, r)));
+                        _mm_store_ps(row + x, _mm_add_ps(_mm_load_ps(row + x), v));
+                    }
+                }
+            }
+        }
+    }
+
+    particle_variant _variant;
+    unsigned _width;
+    unsigned _height;
+    unsigned _tiles_x;
+    unsigned _tiles_y;
+    thread_pool& _pool;
+    float _radius_x;
+    float _radius_y;
+    std::vector<float, aligned_allocator<float, 64>> _pixels;
+    std::vector<disc> _discs;
+    std::vector<std::vector<std::uint32_t>> _bins;     // [chunk][tile]
+    std::size_t _chunks;
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "particles.hpp"
+#include "neighbor_grid.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>    // min, max
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <xmmintrin.h>
+
+namespace sph
+{
+
+// Weakly compressible SPH: density by summation, pressure from the linear
+// equation of state p = STIFFNESS*(rho - REST_DENSITY) (negative pressures
+// clamped), plus artificial viscosity. The smoothing length is chosen so
+// that a particle has about NEIGHBORS neighbours when the fluid covers AREA
+// at rest density.
+float const PI = 3.14159265358979323846f;
+float const REST_DENSITY = 1.0f;
+float const STIFFNESS = 1.0f;           // squared speed of sound
+float const VISCOSITY = 0.1f;           // kinematic viscosity in units of h*c
+float const GRAVITY = 0.05f;
+float const AREA = 2.25f;
+float const NEIGHBORS = 20.0f;
+float const COURANT = 0.4f;
+float const BOUNDS = 1.0f;
+float const WALL_DAMPING = 0.5f;
+// Particles that would move less than this in a step stay where they are,
+// so a settled fluid leaves its positions, and their uploads, untouched.
+float const REST_DISTANCE = 1e-4f;
+// Large counts need very small steps; rather than dropping frames the
+// simulation falls behind real time.
+unsigned const MAX_SUBSTEPS = 2;
+std::size_t const GRAIN = 1024;
+
+inline float horizontal_sum(__m128 v)
+{
+    __m128 t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+}
+
+// Loads four consecutive vec2 and splits them into x and y lanes.
+inline void load_deinterleaved(vec2 const* p, __m128& x, __m128& y)
+{
+    __m128 a = _mm_loadu_ps(&p[0].x);
+    __m128 b = _mm_loadu_ps(&p[2].x);
+    x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+}
+
+struct parameters
+{
+    float h;
+    float h2;
+    float mass;
+    float poly6;        // 4/(pi h^8)
+    float spiky_grad;   // 30/(pi h^5)
+    float viscosity_laplacian;  // 40/(pi h^5)
+    float viscosity;    // kinematic, VISCOSITY*h*c
+};
+
+inline parameters make_parameters(std::size_t count)
+{
+    parameters p;
+    float n = static_cast<float>(std::max<std::size_t>(count, 1));
+    p.h = std::sqrt(NEIGHBORS*AREA/(PI*n));
+    p.h2 = p.h*p.h;
+    p.mass = REST_DENSITY*AREA/n;
+    float h4 = p.h2*p.h2;
+    float h5 = h4*p.h;
+    p.poly6 = 4.0f/(PI*h4*h4);
+    p.spiky_grad = 30.0f/(PI*h5);
+    p.viscosity_laplacian = 40.0f/(PI*h5);
+    p.viscosity = VISCOSITY*p.h*std::sqrt(STIFFNESS);
+    return p;
+}
+
+inline float pressure(float density)
+{
+    return std::max(0.0f, STIFFNESS*(density - REST_DENSITY));
+}
+
+struct compute_density
+{
+    typedef particles::reads<particles::position> reads;
+    typedef particles::writes<particles::density> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>();
+        auto densities = view.template get<particles::density>();
+        __m128 const h2 = _mm_set1_ps(params.h2);
+        for(std::size_t i = begin; i != end; ++i)
+        {
+            vec2 const p = positions[i];
+            __m128 const xi = _mm_set1_ps(p.x);
+            __m128 const yi = _mm_set1_ps(p.y);
+            __m128 sum = _mm_setzero_ps();
+            float tail = 0.0f;
+            grid.for_each_neighbor_range(p, [&](std::uint32_t b, std::uint32_t e) {
+                std::uint32_t j = b;
+                for(; j + 4 <= e; j += 4) {
+                    __m128 xj, yj;
+                    load_deinterleaved(positions + j, xj, yj);
+                    __m128 dx = _mm_sub_ps(xi, xj);
+                    __m128 dy = _mm_sub_ps(yi, yj);
+                    __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+                    __m128 t = _mm_sub_ps(h2, r2);
+                    __m128 w = _mm_mul_ps(_mm_mul_ps(t, t), t);
+                    sum = _mm_add_ps(sum, _mm_and_ps(_mm_cmplt_ps(r2, h2), w));
+                }
+                for(; j != e; ++j) {
+                    float dx = p.x - positions[j].x;
+                    float dy = p.y - positions[j].y;
+                    float t = params.h2 - (dx*dx + dy*dy);
+                    if(t > 0.0f)
+                        tail += t*t*t;
+                }
+            });
+            densities[i] = params.mass*params.poly6*(horizontal_sum(sum) + tail);
+        }
+    }
+
+    neighbor_grid const& grid;
+    parameters const& params;
+};
+
+struct compute_forces
+{
+    typedef particles::reads<particles::position, particles::velocity, particles::density> reads;
+    typedef particles::writes<> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>();
+        auto velocities = view.template get<particles::velocity>();
+        auto densities = view.template get<particles::density>();
+        __m128 const h = _mm_set1_ps(params.h);
+        __m128 const h2 = _mm_set1_ps(params.h2);
+        __m128 const epsilon = _mm_set1_ps(1e-12f);
+        __m128 const zero = _mm_setzero_ps();
+        __m128 const stiffness = _mm_set1_ps(STIFFNESS);
+        __m128 const rest_density = _mm_set1_ps(REST_DENSITY);
+        __m128 const pressure_scale = _mm_set1_ps(params.mass*params.spiky_grad);
+        __m128 const viscosity_scale = _mm_set1_ps(params.viscosity*params.mass*params.viscosity_laplacian);
+        for(std::size_t i = begin; i != end; ++i)
+        {
+            vec2 const p = positions[i];
+            vec2 const v = velocities[i];
+            float const rho = densities[i];
+            float const pi_term = pressure(rho)/(rho*rho);
+            __m128 const xi = _mm_set1_ps(p.x);
+            __m128 const yi = _mm_set1_ps(p.y);
+            __m128 const vxi = _mm_set1_ps(v.x);
+            __m128 const vyi = _mm_set1_ps(v.y);
+            __m128 const pi = _mm_set1_ps(pi_term);
+            __m128 ax = zero;
+            __m128 ay = zero;
+            vec2 tail(0.0f);
+            grid.for_each_neighbor_range(p, [&](std::uint32_t b, std::uint32_t e) {
+                std::uint32_t j = b;
+                for(; j + 4 <= e; j += 4) {
+                    __m128 xj, yj, vxj, vyj;
+                    load_deinterleaved(positions + j, xj, yj);
+                    load_deinterleaved(velocities + j, vxj, vyj);
+                    __m128 rhoj = _mm_loadu_ps(densities + j);
+                    __m128 dx = _mm_sub_ps(xi, xj);
+                    __m128 dy = _mm_sub_ps(yi, yj);
+                    __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+                    __m128 mask = _mm_and_ps(_mm_cmplt_ps(r2, h2), _mm_cmpgt_ps(r2, epsilon));
+                    __m128 r = _mm_sqrt_ps(_mm_max_ps(r2, epsilon));
+                    __m128 q = _mm_sub_ps(h, r);
+
+                    __m128 pj = _mm_max_ps(zero, _mm_mul_ps(stiffness, _mm_sub_ps(rhoj, rest_density)));
+                    __m128 pj_term = _mm_div_ps(pj, _mm_mul_ps(rhoj, rhoj));
+                    __m128 fp = _mm_mul_ps(pressure_scale, _mm_mul_ps(_mm_add_ps(pi, pj_term),
+                        _mm_div_ps(_mm_mul_ps(q, q), r)));
+                    fp = _mm_and_ps(mask, fp);
+                    __m128 fv = _mm_and_ps(mask, _mm_div_ps(_mm_mul_ps(viscosity_scale, q), rhoj));
+
+                    ax = _mm_add_ps(ax, _mm_add_ps(_mm_mul_ps(fp, dx), _mm_mul_ps(fv, _mm_sub_ps(vxj, vxi))));
+                    ay = _mm_add_ps(ay, _mm_add_ps(_mm_mul_ps(fp, dy), _mm_mul_ps(fv, _mm_sub_ps(vyj, vyi))));
+                }
+                for(; j != e; ++j) {
+                    float dx = p.x - positions[j].x;
+                    float dy = p.y - positions[j].y;
+                    float r2 = dx*dx + dy*dy;
+                    if(r2 >= params.h2 || r2 <= 1e-12f)
+                        continue;
+                    float r = std::sqrt(r2);
+                    float q = params.h - r;
+                    float rhoj = densities[j];
+                    float fp = params.mass*params.spiky_grad*(pi_term + pressure(rhoj)/(rhoj*rhoj))*q*q/r;
+                    float fv = params.viscosity*params.mass*params.viscosity_laplacian*q/rhoj;
+                    tail.x += fp*dx + fv*(velocities[j].x - v.x);
+                    tail.y += fp*dy + fv*(velocities[j].y - v.y);
+                }
+            });
+            accelerations[i] = vec2(horizontal_sum(ax) + tail.x, horizontal_sum(ay) + tail.y);
+        }
+    }
+
+    neighbor_grid const& grid;
+    parameters const& params;
+    vec2* accelerations;
+};
+
+struct integrate
+{
+    typedef particles::reads<> reads;
+    typedef particles::writes<particles::position, particles::velocity, particles::age> writes;
+    typedef particles::marks<particles::position> marks;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>();
+        auto velocities = view.template get<particles::velocity>();
+        auto ages = view.template get<particles::age>();
+        std::size_t const chunk_size = particles::chunk_size;
+        for(std::size_t chunk = begin/chunk_size; chunk*chunk_size < end; ++chunk)
+        {
+            std::size_t const first = std::max(begin, chunk*chunk_size);
+            std::size_t const last = std::min(end, (chunk + 1)*chunk_size);
+            bool moved = false;
+            for(std::size_t i = first; i != last; ++i)
+            {
+                vec2 pos = positions[i];
+                vec2 velocity = velocities[i] + dt*(accelerations[i] + -pos*GRAVITY);
+                pos += dt*velocity;
+                if(pos.x < -BOUNDS || pos.x > BOUNDS) {
+                    pos.x = std::max(-BOUNDS, std::min(BOUNDS, pos.x));
+                    velocity.x *= -WALL_DAMPING;
+                }
+                if(pos.y < -BOUNDS || pos.y > BOUNDS) {
+                    pos.y = std::max(-BOUNDS, std::min(BOUNDS, pos.y));
+                    velocity.y *= -WALL_DAMPING;
+                }
+                vec2 const step = pos + -positions[i];
+                if(dot(step, step) >= REST_DISTANCE*REST_DISTANCE) {
+                    positions[i] = pos;
+                    moved = true;
+                }
+                velocities[i] = velocity;
+                ages[i] += dt;
+            }
+            if(moved)
+                view.template mark<particles::position>(first, last);
+        }
+    }
+
+    vec2 const* accelerations;
+    float dt;
+};
+
+class solver
+{
+public:
+    explicit solver(thread_pool& pool) :
+        _pool(pool)
+    {
+    }
+
+    template <class Store>
+    void simulate(Store& store, float dt)
+    {
+        std::size_t const count = store.size();
+        parameters const params = make_parameters(count);
+        _accelerations.resize(count);
+
+        float const max_step = COURANT*params.h/std::sqrt(STIFFNESS);
+        unsigned substeps = static_cast<unsigned>(std::ceil(dt/max_step));
+        substeps = std::max(1u, std::min(MAX_SUBSTEPS, substeps));
+        float const step = std::min(dt/substeps, max_step);
+
+        for(unsigned s = 0; s != substeps; ++s) {
+            _grid.build(store, params.h, _pool);
+            for_each_range(store, compute_density{_grid, params});
+            for_each_range(store, compute_forces{_grid, params, _accelerations.data()});
+            for_each_range(store, integrate{_accelerations.data(), step});
+        }
+    }
+
+private:
+    template <class Store, class Kernel>
+    void for_each_range(Store& store, Kernel const& kernel)
+    {
+        _pool.parallel_for(store.size(), GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            store.run(kernel, begin, end);
+        });
+    }
+
+    thread_pool& _pool;
+    neighbor_grid _grid;
+    std::vector<vec2, aligned_allocator<vec2, particles::alignment>> _accelerations;
+};
+
+}   // namespace sph
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>    // max, min
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel loops. The calling thread
+// takes part in every loop as thread 0, so a pool of size 1 runs everything
+// inline.
+class thread_pool
+{
+public:
+    explicit thread_pool(unsigned threads = std::thread::hardware_concurrency()) :
+        _generation(0),
+        _busy(0),
+        _stop(false)
+    {
+        threads = std::max(1u, threads);
+        for(unsigned i = 1; i != threads; ++i)
+            _workers.emplace_back([this, i] { worker(i); });
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for(auto& worker : _workers)
+            worker.join();
+    }
+
+    thread_pool(thread_pool const&) = delete;
+    thread_pool& operator=(thread_pool const&) = delete;
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(_workers.size()) + 1;
+    }
+
+    // Calls fn(thread, begin, end) over [0, count) in chunks of at most grain
+    // elements. Chunks are handed out dynamically; thread is in [0, size()).
+    template <class Fn>
+    void parallel_for(std::size_t count, std::size_t grain, Fn fn)
+    {
+        if(count == 0)
+            return;
+        grain = std::max<std::size_t>(1, grain);
+        if(_workers.empty() || count <= grain) {
+            fn(0u, std::size_t(0), count);
+            return;
+        }
+
+        std::atomic<std::size_t> next(0);
+        _job = [&](unsigned thread) {
+            for(;;) {
+                std::size_t begin = next.fetch_add(grain);
+                if(begin >= count)
+                    break;
+                fn(thread, begin, std::min(count, begin + grain));
+            }
+        };
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _busy = static_cast<unsigned>(_workers.size());
+            ++_generation;
+        }
+        _wake.notify_all();
+        _job(0);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _busy == 0; });
+        _job = nullptr;
+    }
+
+private:
+    void worker(unsigned thread)
+    {
+        unsigned long long seen = 0;
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&] { return _stop || _generation != seen; });
+                if(_stop)
+                    return;
+                seen = _generation;
+            }
+            _job(thread);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                --_busy;
+            }
+            _done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> _workers;
+    std::function<void(unsigned)> _job;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    unsigned long long _generation;
+    unsigned _busy;
+    bool _stop;
+};
@@ -1,43 +1,232 @@
-#include <Windows.h>
+#pragma once
+
+#include <chrono>
+#include <cmath>        // sqrt
+#include <cstdint>
 #include <stdexcept>
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define TIMER_X86
+#include <emmintrin.h>  // _mm_pause
+#else
+#include <thread>       // this_thread::yield
+#endif
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX        // or std::min and std::max stop compiling
+#endif
+#include <Windows.h>
+#elif defined(__linux__)
+#include <cerrno>
+#include <time.h>
+#else
+#include <thread>
+#endif
+
+// Monotonic time since construction as 64-bit nanoseconds, which do not wrap
+// for centuries, and sleeping until a deadline on that time line.
+//
+// The OS wakes a sleeping thread late by an amount that depends on the
+// system and its load, so sleep_until() sleeps until a slack before the
+// deadline and spins for the rest, on pause on x86 and yielding elsewhere.
+// The slack follows the tail of the oversleeps measured so far: it jumps up
+// to any oversleep larger than itself and otherwise decays towards recent
+// ones, so a single late wake-up costs a few more microseconds of spinning
+// for a while, not a missed frame every time. statistics() tells how long was spent spinning and how
+// closely deadlines were met.
+//
+// On Windows the clock is QueryPerformanceCounter: VS2013's steady_clock
+// is the system clock, which can jump and ticks in milliseconds. On Linux
+// it is CLOCK_MONOTONIC, and the sleep a clock_nanosleep(TIMER_ABSTIME) on
+// the same clock, so it neither accumulates rounding nor oversleeps after a
+// signal. Elsewhere it is std::chrono::steady_clock.
 class timer
 {
 public:
-    timer()
+    typedef std::chrono::nanoseconds duration;
+
+    static std::int64_t const INITIAL_SLACK = 1000000;   // ns, before anything is measured
+    static std::int64_t const MAX_SLACK = 4000000;       // ns; longer spins cost more than a late frame
+    static std::int64_t const MARGIN = 50000;            // ns added to the measured oversleep
+    static std::int64_t const DECAY = 64;                // wake-ups for the slack to shrink by ~63%
+
+    // Pacing since the last reset_statistics().
+    struct statistics_type
     {
-        if (TIMERR_NOERROR != timeBeginPeriod(1))
+        unsigned sleeps;        // deadlines waited for
+        unsigned missed;        // deadlines already past when sleep_until() was called
+        duration slack;         // current slack
+        duration spin;          // total time spent spinning
+        double late_mean;       // ns past the deadlines waited for
+        double late_deviation;  // ns, standard deviation
+    };
+
+    timer() :
+        _oversleep(INITIAL_SLACK - MARGIN)
+    {
+#if defined(_WIN32)
+        // Lets Sleep wake within about a millisecond.
+        if(TIMERR_NOERROR != timeBeginPeriod(1))
             throw std::runtime_error("cannot set global timer resolution");
-        _start = timeGetTime();
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        _frequency = frequency.QuadPart;
+#endif
+        _start = now();
+        reset_statistics();
     }
+
     ~timer()
     {
+#if defined(_WIN32)
         timeEndPeriod(1);
+#endif
     }
 
-    unsigned get()
-    {
-        return (timeGetTime() - _start);
-    }
+    timer(timer const&) = delete;
+    timer& operator=(timer const&) = delete;
 
-    void sleep_for(unsigned milliseconds)
+    // Time since construction.
+    duration get() const
     {
-        Sleep(milliseconds);
+        return duration(now() - _start);
     }
 
-    void sleep_until(unsigned milliseconds)
+    // Returns once get() >= deadline.
+    void sleep_until(duration deadline)
     {
-        DWORD deadline = _start;
-        deadline += milliseconds;
-        DWORD now = timeGetTime();
-        if(now < deadline) {
-            Sleep(deadline - now - 1);
+        std::int64_t const target = _start + deadline.count();
+        std::int64_t time = now();
+        if(time >= target) {
+            ++_missed;
+            return;
         }
-        while(timeGetTime() < deadline) {
-            Sleep(0);
+
+        std::int64_t const wake = target - slack();
+        if(time < wake) {
+            os_sleep_until(wake);
+            time = now();
+            // A hiccup far beyond MAX_SLACK should not keep the slack
+            // pinned there while it decays.
+            std::int64_t oversleep = time > wake ? time - wake : 0;
+            if(oversleep > MAX_SLACK)
+                oversleep = MAX_SLACK;
+            if(oversleep > _oversleep)
+                _oversleep = oversleep;
+            else
+                _oversleep -= (_oversleep - oversleep)/DECAY;
+        }
+
+        std::int64_t const spin_start = time;
+        while(time < target) {
+            spin_pause();
+            time = now();
         }
+        _spin += time - spin_start;
+        ++_sleeps;
+        double const late = static_cast<double>(time - target);
+        _late_sum += late;
+        _late_squares += late*late;
+    }
+
+    void sleep_for(duration time)
+    {
+        sleep_until(get() + time);
+    }
+
+    statistics_type statistics() const
+    {
+        statistics_type result;
+        result.sleeps = _sleeps;
+        result.missed = _missed;
+        result.slack = duration(slack());
+        result.spin = duration(_spin);
+        result.late_mean = _sleeps ? _late_sum/_sleeps : 0.0;
+        double const variance = _sleeps ? _late_squares/_sleeps - result.late_mean*result.late_mean : 0.0;
+        result.late_deviation = variance > 0.0 ? std::sqrt(variance) : 0.0;
+        return result;
+    }
+
+    void reset_statistics()
+    {
+        _sleeps = 0;
+        _missed = 0;
+        _spin = 0;
+        _late_sum = 0.0;
+        _late_squares = 0.0;
     }
 
 private:
-    DWORD _start;
+    std::int64_t slack() const
+    {
+        std::int64_t const slack = _oversleep + MARGIN;
+        if(slack > MAX_SLACK)
+            return MAX_SLACK;
+        return slack;
+    }
+
+    // Eases a spin-wait iteration: pause on x86, a yield elsewhere.
+    static void spin_pause()
+    {
+#if defined(TIMER_X86)
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    // Sleeps until about time on the underlying clock, possibly less.
+    void os_sleep_until(std::int64_t time)
+    {
+#if defined(_WIN32)
+        // Sleep rounds up to the timer period, so round down here and let
+        // the spin make up the difference.
+        std::int64_t const remaining = time - now();
+        if(remaining >= 1000000)
+            Sleep(static_cast<DWORD>(remaining/1000000));
+#elif defined(__linux__)
+        timespec until;
+        until.tv_sec = static_cast<time_t>(time/1000000000);
+        until.tv_nsec = static_cast<long>(time % 1000000000);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, nullptr) == EINTR) {
+        }
+#else
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration(time))));
+#endif
+    }
+
+    // Nanoseconds on the underlying clock.
+    std::int64_t now() const
+    {
+#if defined(_WIN32)
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        // Split to keep counter*1e9 from overflowing.
+        std::int64_t const seconds = counter.QuadPart/_frequency;
+        std::int64_t const rest = counter.QuadPart % _frequency;
+        return seconds*1000000000 + rest*1000000000/_frequency;
+#elif defined(__linux__)
+        // The clock clock_nanosleep waits on, read directly rather than
+        // trusting steady_clock to be the same one.
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return static_cast<std::int64_t>(time.tv_sec)*1000000000 + time.tv_nsec;
+#else
+        return std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+#if defined(_WIN32)
+    std::int64_t _frequency;
+#endif
+    std::int64_t _start;
+    std::int64_t _oversleep;    // ns, tail of the measured oversleeps
+
+    unsigned _sleeps;
+    unsigned _missed;
+    std::int64_t _spin;         // ns
+    double _late_sum;
+    double _late_squares;
 };
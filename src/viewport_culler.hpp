@@ -0,0 +1,154 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>    // min
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <emmintrin.h>
+
+// Packs the particles that can touch the viewport, in order, into an array
+// such as a mapped vertex buffer, so upload and vertex work follow what is
+// on screen.
+//
+// count() tests four particles at a time and records a 4-bit mask per group
+// and the number of survivors per chunk. An exclusive prefix sum over the
+// chunks then gives every chunk its output offset, so compact() writes all
+// chunks in parallel. SSE has no compress-store; each mask indexes a table
+// of the lanes to keep instead.
+class viewport_culler
+{
+public:
+    static std::size_t const GRAIN = 16384; // particles per chunk; a multiple of 4
+    static std::size_t const SCAN_GRAIN = 1024; // chunks per block of the offset scan
+
+    explicit viewport_culler(thread_pool& pool) :
+        _pool(pool),
+        _count(0)
+    {
+    }
+
+    // Tests positions [0, count) against the NDC square grown by extent_x
+    // and extent_y, a particle's half size, and returns how many pass.
+    std::size_t count(vec2 const* positions, std::size_t count, float extent_x, float extent_y)
+    {
+        std::size_t const chunks = (count + GRAIN - 1)/GRAIN;
+        _count = count;
+        _masks.resize((count + 3)/4);
+        _offsets.resize(chunks + 1);
+        _pool.parallel_for(count, GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t chunk = begin/GRAIN; chunk*GRAIN < end; ++chunk)
+                _offsets[chunk + 1] = test(positions, chunk*GRAIN, std::min(count, (chunk + 1)*GRAIN),
+                    extent_x, extent_y);
+        });
+        // Blocks of chunks sum their counts, the block sums are scanned, and
+        // then each block turns its counts into offsets from its start. Up
+        // to SCAN_GRAIN chunks, 16M particles, that is one block run inline.
+        std::size_t const blocks = (chunks + SCAN_GRAIN - 1)/SCAN_GRAIN;
+        _block_start.resize(blocks + 1);
+        _pool.parallel_for(chunks, SCAN_GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t block = begin/SCAN_GRAIN; block*SCAN_GRAIN < end; ++block) {
+                std::size_t sum = 0;
+                for(std::size_t chunk = block*SCAN_GRAIN; chunk != std::min(chunks, (block + 1)*SCAN_GRAIN); ++chunk)
+                    sum += _offsets[chunk + 1];
+                _block_start[block + 1] = sum;
+            }
+        });
+        _block_start[0] = 0;
+        for(std::size_t block = 0; block != blocks; ++block)
+            _block_start[block + 1] += _block_start[block];
+        _pool.parallel_for(chunks, SCAN_GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t block = begin/SCAN_GRAIN; block*SCAN_GRAIN < end; ++block) {
+                // Only this block's entries are touched: each holds its
+                // chunk's count and becomes the next chunk's offset.
+                std::size_t offset = _block_start[block];
+                for(std::size_t chunk = block*SCAN_GRAIN; chunk != std::min(chunks, (block + 1)*SCAN_GRAIN); ++chunk) {
+                    offset += _offsets[chunk + 1];
+                    _offsets[chunk + 1] = offset;
+                }
+            }
+        });
+        _offsets[0] = 0;
+        return _offsets[chunks];
+    }
+
+    // Writes the particles that passed the last count(), which must have
+    // been given the same positions, to out[0, count()).
+    void compact(vec2 const* positions, vec2* out) const
+    {
+        _pool.parallel_for(_count, GRAIN, [&](unsigned, std::size_t begin, std::size_t end) {
+            for(std::size_t chunk = begin/GRAIN; chunk*GRAIN < end; ++chunk)
+                pack(positions, chunk*GRAIN, std::min(_count, (chunk + 1)*GRAIN), out + _offsets[chunk]);
+        });
+    }
+
+private:
+    static unsigned char const POPCOUNT[16];
+    static unsigned char const LANES[16][4];
+
+    std::size_t test(vec2 const* positions, std::size_t begin, std::size_t end,
+        float extent_x, float extent_y)
+    {
+        __m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 const max_x = _mm_set1_ps(1.0f + extent_x);
+        __m128 const max_y = _mm_set1_ps(1.0f + extent_y);
+        std::size_t visible = 0;
+        std::size_t i = begin;
+        for(; i + 4 <= end; i += 4) {
+            __m128 a = _mm_loadu_ps(&positions[i].x);
+            __m128 b = _mm_loadu_ps(&positions[i + 2].x);
+            __m128 x = _mm_and_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), abs_mask);
+            __m128 y = _mm_and_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), abs_mask);
+            // NaNs compare false and are dropped.
+            int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(x, max_x), _mm_cmple_ps(y, max_y)));
+            _masks[i/4] = static_cast<std::uint8_t>(mask);
+            visible += POPCOUNT[mask];
+        }
+        if(i != end) {
+            int mask = 0;
+            for(std::size_t lane = 0; i + lane != end; ++lane) {
+                vec2 p = positions[i + lane];
+                if(p.x >= -1.0f - extent_x && p.x <= 1.0f + extent_x && p.y >= -1.0f - extent_y && p.y <= 1.0f + extent_y)
+                    mask |= 1 << lane;
+            }
+            _masks[i/4] = static_cast<std::uint8_t>(mask);
+            visible += POPCOUNT[mask];
+        }
+        return visible;
+    }
+
+    void pack(vec2 const* positions, std::size_t begin, std::size_t end, vec2* out) const
+    {
+        for(std::size_t i = begin; i < end; i += 4) {
+            unsigned mask = _masks[i/4];
+            if(mask == 0xf) {
+                // Whole groups are the common case and write full lines.
+                _mm_storeu_ps(&out[0].x, _mm_loadu_ps(&positions[i].x));
+                _mm_storeu_ps(&out[2].x, _mm_loadu_ps(&positions[i + 2].x));
+                out += 4;
+                continue;
+            }
+            unsigned char const* lanes = LANES[mask];
+            for(unsigned k = 0; k != POPCOUNT[mask]; ++k)
+                out[k] = positions[i + lanes[k]];
+            out += POPCOUNT[mask];
+        }
+    }
+
+    thread_pool& _pool;
+    std::size_t _count;
+    std::vector<std::uint8_t> _masks;       // one per group of four
+    std::vector<std::size_t> _offsets;      // output offset per chunk, then the total
+    std::vector<std::size_t> _block_start;  // offset per block of the scan, then the total
+};
+
+unsigned char const viewport_culler::POPCOUNT[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+
+unsigned char const viewport_culler::LANES[16][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {1, 0, 0, 0}, {0, 1, 0, 0},
+    {2, 0, 0, 0}, {0, 2, 0, 0}, {1, 2, 0, 0}, {0, 1, 2, 0},
+    {3, 0, 0, 0}, {0, 3, 0, 0}, {1, 3, 0, 0}, {0, 1, 3, 0},
+    {2, 3, 0, 0}, {0, 2, 3, 0}, {1, 2, 3, 0}, {0, 1, 2, 3},
+};
@@ -0,0 +1,358 @@
+#pragma once
+
+#include "vec2.hpp"
+#include "particles.hpp"
+
+#include <algorithm>    // sort, lower_bound, min, max
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <xmmintrin.h>
+
+namespace vortex
+{
+
+float const PI = 3.14159265358979323846f;
+
+// Particles carrying a non-zero particles::circulation are vortex blobs; all
+// particles (blobs included) are advected by the velocity the blobs induce.
+// Velocities are summed with a smoothed Biot-Savart kernel,
+//     u = G/(2 pi) * (-dy, dx) / (r^2 + delta^2),
+// over a quadtree of the blobs. Cells that are far enough away from a batch
+// of targets (cell radius < THETA*distance) are replaced by a truncated
+// multipole expansion about their centre. In complex notation the conjugate
+// velocity is -i/(2 pi) * sum_k a_k/(z - c)^(k+1) with a_k = sum_j G_j (z_j - c)^k.
+float const SMOOTHING = 0.01f;
+float const THETA = 0.5f;
+std::size_t const LEAF_SIZE = 16;
+unsigned const MAX_DEPTH = 16;
+unsigned const MULTIPOLE_TERMS = 4;
+
+class tree
+{
+public:
+    tree() :
+        _origin(0.0f),
+        _size(1.0f)
+    {
+    }
+
+    // Builds the tree over the blobs in positions[0..count) and sorts all
+    // particles into target batches along the same Morton order.
+    void build(vec2 const* positions, float const* circulations, std::size_t count)
+    {
+        compute_bounds(positions, count);
+
+        _keys.resize(count);
+        for(std::size_t i = 0; i != count; ++i) {
+            std::uint64_t code = morton_code(positions[i]);
+            _keys[i] = (code << 32) | i;
+        }
+        std::sort(_keys.begin(), _keys.end());
+
+        _targets.resize(count);
+        _source_codes.clear();
+        _source_x.clear();
+        _source_y.clear();
+        _source_circulation.clear();
+        for(std::size_t i = 0; i != count; ++i) {
+            auto index = static_cast<std::uint32_t>(_keys[i]);
+            _targets[i] = index;
+            float circulation = circulations[index];
+            if(circulation != 0.0f) {
+                _source_codes.push_back(static_cast<std::uint32_t>(_keys[i] >> 32));
+                _source_x.push_back(positions[index].x);
+                _source_y.push_back(positions[index].y);
+                // Fold the 1/(2 pi) of the kernel into the strength.
+                _source_circulation.push_back(circulation*(0.5f/PI));
+            }
+        }
+
+        _nodes.clear();
+        if(_source_codes.empty())
+            return;
+        _nodes.push_back(node());
+        build_node(0, 0, 0, static_cast<std::uint32_t>(_source_codes.size()), _origin, _size);
+    }
+
+    // Writes the induced velocity of every particle passed to build() into
+    // velocities.
+    void evaluate(vec2 const* positions, vec2* velocities) const
+    {
+        std::size_t const count = _targets.size();
+        std::vector<std::uint32_t> stack;
+        for(std::size_t batch = 0; batch < count; batch += 4)
+        {
+            std::uint32_t index[4];
+            for(std::size_t lane = 0; lane != 4; ++lane)
+                index[lane] = _targets[std::min(batch + lane, count - 1)];
+
+            __m128 tx = _mm_setr_ps(positions[index[0]].x, positions[index[1]].x,
+                positions[index[2]].x, positions[index[3]].x);
+            __m128 ty = _mm_setr_ps(positions[index[0]].y, positions[index[1]].y,
+                positions[index[2]].y, positions[index[3]].y);
+            __m128 ux = _mm_setzero_ps();
+            __m128 uy = _mm_setzero_ps();
+
+            if(!_nodes.empty())
+                evaluate_batch(tx, ty, ux, uy, stack);
+
+            float rx[4], ry[4];
+            _mm_storeu_ps(rx, ux);
+            _mm_storeu_ps(ry, uy);
+            for(std::size_t lane = 0; lane != 4 && batch + lane != count; ++lane)
+                velocities[index[lane]] = vec2(rx[lane], ry[lane]);
+        }
+    }
+
+private:
+    struct node
+    {
+        float x, y;             // expansion centre (centre of |circulation|)
+        float radius;           // distance from centre to farthest blob
+        float re[MULTIPOLE_TERMS];  // multipole coefficients, scaled by 1/(2 pi)
+        float im[MULTIPOLE_TERMS];
+        std::uint32_t children; // index of first of four children, 0 for leaves
+        std::uint32_t begin, end;
+    };
+
+    void compute_bounds(vec2 const* positions, std::size_t count)
+    {
+        vec2 lo(0.0f), hi(0.0f);
+        if(count != 0)
+            lo = hi = positions[0];
+        for(std::size_t i = 1; i < count; ++i) {
+            lo.x = std::min(lo.x, positions[i].x);
+            lo.y = std::min(lo.y, positions[i].y);
+            hi.x = std::max(hi.x, positions[i].x);
+            hi.y = std::max(hi.y, positions[i].y);
+        }
+        float size = std::max(hi.x - lo.x, hi.y - lo.y);
+        _size = size*1.001f + 1e-6f;
+        _origin = lo;
+    }
+
+    static std::uint32_t spread_bits(std::uint32_t v)
+    {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    std::uint32_t morton_code(vec2 const& p) const
+    {
+        float const scale = 65535.0f/_size;
+        auto x = static_cast<std::uint32_t>(std::max(0.0f, std::min(65535.0f, (p.x - _origin.x)*scale)));
+        auto y = static_cast<std::uint32_t>(std::max(0.0f, std::min(65535.0f, (p.y - _origin.y)*scale)));
+        return spread_bits(x) | (spread_bits(y) << 1);
+    }
+
+    void build_node(std::uint32_t index, unsigned depth, std::uint32_t begin, std::uint32_t end,
+        vec2 origin, float size)
+    {
+        node n;
+        n.radius = 0.0f;
+        n.children = 0;
+        n.begin = begin;
+        n.end = end;
+
+        float weight = 0.0f;
+        float x = 0.0f, y = 0.0f;
+        for(std::uint32_t i = begin; i != end; ++i) {
+            float g = _source_circulation[i];
+            float w = g < 0.0f ? -g : g;
+            weight += w;
+            x += w*_source_x[i];
+            y += w*_source_y[i];
+        }
+        if(weight > 0.0f) {
+            n.x = x/weight;
+            n.y = y/weight;
+        } else {
+            n.x = origin.x + 0.5f*size;
+            n.y = origin.y + 0.5f*size;
+        }
+
+        for(unsigned k = 0; k != MULTIPOLE_TERMS; ++k)
+            n.re[k] = n.im[k] = 0.0f;
+        for(std::uint32_t i = begin; i != end; ++i) {
+            float dx = _source_x[i] - n.x;
+            float dy = _source_y[i] - n.y;
+            n.radius = std::max(n.radius, dx*dx + dy*dy);
+            // Accumulate G*(dx + i dy)^k.
+            float pr = _source_circulation[i], pi = 0.0f;
+            for(unsigned k = 0; k != MULTIPOLE_TERMS; ++k) {
+                n.re[k] += pr;
+                n.im[k] += pi;
+                float t = pr*dx - pi*dy;
+                pi = pr*dy + pi*dx;
+                pr = t;
+            }
+        }
+        n.radius = std::sqrt(n.radius);
+
+        if(end - begin > LEAF_SIZE && depth < MAX_DEPTH) {
+            auto children = static_cast<std::uint32_t>(_nodes.size());
+            n.children = children;
+            _nodes.resize(_nodes.size() + 4);
+
+            unsigned const shift = 2*(MAX_DEPTH - 1 - depth);
+            auto const mask = ~static_cast<std::uint32_t>((std::uint64_t(1) << (shift + 2)) - 1);
+            std::uint32_t const prefix = _source_codes[begin] & mask;
+            auto const first = _source_codes.begin();
+            std::uint32_t child_begin = begin;
+            float const half = 0.5f*size;
+            for(std::uint32_t q = 0; q != 4; ++q) {
+                std::uint32_t child_end = end;
+                if(q != 3) {
+                    std::uint32_t bound = prefix | ((q + 1) << shift);
+                    child_end = static_cast<std::uint32_t>(
+                        std::lower_bound(first + child_begin, first + end, bound) - first);
+                }
+                vec2 child_origin(origin.x + ((q & 1) ? half : 0.0f),
+                    origin.y + ((q & 2) ? half : 0.0f));
+                build_node(children + q, depth + 1, child_begin, child_end, child_origin, half);
+                child_begin = child_end;
+            }
+        }
+        _nodes[index] = n;
+    }
+
+    void accumulate(__m128 tx, __m128 ty, float x, float y, float circulation,
+        __m128& ux, __m128& uy) const
+    {
+        __m128 dx = _mm_sub_ps(tx, _mm_set1_ps(x));
+        __m128 dy = _mm_sub_ps(ty, _mm_set1_ps(y));
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+            _mm_set1_ps(SMOOTHING*SMOOTHING));
+        __m128 s = _mm_div_ps(_mm_set1_ps(circulation), r2);
+        ux = _mm_sub_ps(ux, _mm_mul_ps(dy, s));
+        uy = _mm_add_ps(uy, _mm_mul_ps(dx, s));
+    }
+
+    void accumulate_multipole(__m128 tx, __m128 ty, node const& n, __m128& ux, __m128& uy) const
+    {
+        // inv = 1/(z - c), then w = inv*(a0 + inv*(a1 + ...)) by Horner.
+        __m128 dx = _mm_sub_ps(tx, _mm_set1_ps(n.x));
+        __m128 dy = _mm_sub_ps(ty, _mm_set1_ps(n.y));
+        __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 s = _mm_div_ps(_mm_set1_ps(1.0f), r2);
+        __m128 inv_re = _mm_mul_ps(dx, s);
+        __m128 inv_im = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(dy, s));
+
+        __m128 w_re = _mm_set1_ps(n.re[MULTIPOLE_TERMS - 1]);
+        __m128 w_im = _mm_set1_ps(n.im[MULTIPOLE_TERMS - 1]);
+        for(unsigned k = MULTIPOLE_TERMS - 1; k-- != 0;) {
+            __m128 t_re = _mm_sub_ps(_mm_mul_ps(w_re, inv_re), _mm_mul_ps(w_im, inv_im));
+            __m128 t_im = _mm_add_ps(_mm_mul_ps(w_re, inv_im), _mm_mul_ps(w_im, inv_re));
+            w_re = _mm_add_ps(t_re, _mm_set1_ps(n.re[k]));
+            w_im = _mm_add_ps(t_im, _mm_set1_ps(n.im[k]));
+        }
+        __m128 t_re = _mm_sub_ps(_mm_mul_ps(w_re, inv_re), _mm_mul_ps(w_im, inv_im));
+        __m128 t_im = _mm_add_ps(_mm_mul_ps(w_re, inv_im), _mm_mul_ps(w_im, inv_re));
+
+        // u - i v = -i w
+        ux = _mm_add_ps(ux, t_im);
+        uy = _mm_add_ps(uy, t_re);
+    }
+
+    void evaluate_batch(__m128 tx, __m128 ty, __m128& ux, __m128& uy,
+        std::vector<std::uint32_t>& stack) const
+    {
+        float px[4], py[4];
+        _mm_storeu_ps(px, tx);
+        _mm_storeu_ps(py, ty);
+        float const x0 = std::min(std::min(px[0], px[1]), std::min(px[2], px[3]));
+        float const y0 = std::min(std::min(py[0], py[1]), std::min(py[2], py[3]));
+        float const x1 = std::max(std::max(px[0], px[1]), std::max(px[2], px[3]));
+        float const y1 = std::max(std::max(py[0], py[1]), std::max(py[2], py[3]));
+
+        stack.clear();
+        stack.push_back(0);
+        while(!stack.empty()) {
+            node const& n = _nodes[stack.back()];
+            stack.pop_back();
+            if(n.begin == n.end)
+                continue;
+
+            // Distance from the expansion centre to the batch bounds.
+            float dx = std::max(0.0f, std::max(x0 - n.x, n.x - x1));
+            float dy = std::max(0.0f, std::max(y0 - n.y, n.y - y1));
+            float d2 = dx*dx + dy*dy;
+            // Expansions ignore the smoothing, so they are only used well
+            // outside the blob core.
+            float const core = 10.0f*SMOOTHING;
+            if(n.radius*n.radius < THETA*THETA*d2 && core*core < d2) {
+                accumulate_multipole(tx, ty, n, ux, uy);
+            } else if(n.children == 0) {
+                for(std::uint32_t i = n.begin; i != n.end; ++i)
+                    accumulate(tx, ty, _source_x[i], _source_y[i], _source_circulation[i], ux, uy);
+            } else {
+                for(std::uint32_t q = 0; q != 4; ++q)
+                    stack.push_back(n.children + q);
+            }
+        }
+    }
+
+    vec2 _origin;
+    float _size;
+    std::vector<std::uint64_t> _keys;
+    std::vector<std::uint32_t> _targets;
+    std::vector<std::uint32_t> _source_codes;
+    std::vector<float> _source_x;
+    std::vector<float> _source_y;
+    std::vector<float> _source_circulation;
+    std::vector<node> _nodes;
+};
+
+struct induce
+{
+    typedef particles::reads<particles::position, particles::circulation> reads;
+    typedef particles::writes<particles::velocity> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>() + begin;
+        auto circulations = view.template get<particles::circulation>() + begin;
+        auto velocities = view.template get<particles::velocity>() + begin;
+        vortex_tree.build(positions, circulations, end - begin);
+        vortex_tree.evaluate(positions, velocities);
+    }
+
+    tree& vortex_tree;
+};
+
+struct advect
+{
+    typedef particles::reads<particles::velocity> reads;
+    typedef particles::writes<particles::position, particles::age> writes;
+
+    template <class View>
+    void operator()(View const& view, std::size_t begin, std::size_t end) const
+    {
+        auto positions = view.template get<particles::position>();
+        auto velocities = view.template get<particles::velocity>();
+        auto ages = view.template get<particles::age>();
+        for(std::size_t i = begin; i != end; ++i)
+        {
+            positions[i] += dt*velocities[i];
+            ages[i] += dt;
+        }
+    }
+
+    float dt;
+};
+
+template <class Store>
+void simulate(Store& store, tree& vortex_tree, float dt)
+{
+    store.run(induce{vortex_tree});
+    store.run(advect{dt});
+}
+
+}   // namespace vortex